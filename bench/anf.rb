@@ -0,0 +1,31 @@
+#!/usr/bin/env ruby
+# Times ANF conversion of function bodies with more and more statements. The
+# time to parse (-Aast) is subtracted from the time to normalize (-Aanf), so
+# the ns/stmt column stays flat when conversion is linear in the block length.
+require 'benchmark'
+
+shapes = {
+  "atoms" => "1 ",
+  "calls" => "foo(bar(), baz()) ",
+  "ifs"   => "if a then f(b) else g(c) end ",
+}
+counts = (ENV['COUNTS'] || "1000,10000,100000,1000000").split(",").map(&:to_i)
+path = "bench/anf.scl"
+
+def best_of(artifact, path)
+  (1..3).map do
+    Benchmark.realtime { system("./sclpl", artifact, path, :out => File::NULL) }
+  end.min
+end
+
+shapes.each do |name, stmt|
+  counts.each do |count|
+    File.write(path, "fn() " + (stmt * count) + ";")
+    parse = best_of("-Aast", path)
+    total = best_of("-Aanf", path)
+    anf = [total - parse, 0].max
+    printf("%-6s %8d stmts  parse %7.3f s  anf %7.3f s %7.1f ns/stmt\n", name,
+           count, parse, anf, anf * 1e9 / count)
+  end
+end
+File.delete(path)
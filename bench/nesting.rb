@@ -0,0 +1,29 @@
+#!/usr/bin/env ruby
+# Times parsing (-Aast) of pathologically nested inputs at increasing depths,
+# once with the default stack and once more under a 256KB stack limit to show
+# that the nesting depth no longer depends on it.
+require 'benchmark'
+
+shapes = {
+  "calls"  => lambda {|n| ("f(" * n) + "1" + (")" * n) },
+  "parens" => lambda {|n| ("(" * n) + "1" + (")" * n) },
+  "ifs"    => lambda {|n| ("if a then " * n) + "b" + (" end" * n) },
+  "fns"    => lambda {|n| ("fn(a) " * n) + "a" + (" end" * n) },
+}
+depths = (ENV['DEPTHS'] || "1000,10000,100000,1000000").split(",").map(&:to_i)
+path = "bench/nesting.scl"
+
+shapes.each do |name, gen|
+  depths.each do |depth|
+    input = gen.call(depth)
+    File.write(path, input)
+    best = (1..3).map do
+      Benchmark.realtime { system("./sclpl", "-Aast", path, :out => File::NULL) }
+    end.min
+    small = system("sh", "-c", "ulimit -s 256 && exec ./sclpl -Aast #{path}",
+                   :out => File::NULL, :err => File::NULL)
+    printf("%-7s depth %8d %7.3f s %7.1f ns/level  256KB stack: %s\n", name,
+           depth, best, best * 1e9 / depth, small ? "ok" : "failed")
+  end
+end
+File.delete(path)
@@ -0,0 +1,30 @@
+#!/usr/bin/env ruby
+# Compares the throughput of the flex lexer (sclpl) and the hand-written SIMD
+# scanner (sclpl-simd) on a generated input of SIZE megabytes (default 16).
+require 'benchmark'
+
+size = (ENV['SIZE'] || 16).to_i << 20
+forms = [
+  "def foo_%d(a, b) if a then bar(b, 0h1F, \\space) else baz(a, 12.5e3) end end\n",
+  "def str_%d \"a longer string literal with an \\\" escaped quote\";\n",
+  "require \"module_%d\";\n",
+  "quux_%d(+123, -456, 0b1010, 0o777, 0d99, true, false, \\newline)\n",
+]
+input = ""
+i = 0
+while input.bytesize < size
+  input << (forms[i % forms.length] % i)
+  i += 1
+end
+path = "bench/scanner.scl"
+File.write(path, input)
+
+%w(tok ast).each do |artifact|
+  %w(./sclpl ./sclpl-simd).each do |bin|
+    best = (1..5).map do
+      Benchmark.realtime { system(bin, "-A#{artifact}", path, :out => File::NULL) }
+    end.min
+    printf("%-12s -A%-4s %7.3f s %8.1f MB/s\n", bin, artifact, best, input.bytesize / best / (1 << 20))
+  end
+end
+File.delete(path)
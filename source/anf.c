@@ -18,73 +18,78 @@ static bool isatomic(AST* tree)
     }
 }
 
-static bool isconst(AST* tree) {
-    bool ret = isatomic(tree);
-    if (!ret && tree->type == AST_FNAPP) {
-        ret = isatomic(fnapp_fn(tree));
-        for (int i = 0; i < vec_size(fnapp_args(tree)); i++) {
-            ret = ret && isatomic(vec_at(fnapp_args(tree), i));
-        }
-    }
-    return ret;
+/* The bindings that have to be made before an expression can be evaluated
+ * are appended to a chain of lets as they are found. The body of the last let
+ * is left open for the rest of the block, so each statement is spliced in
+ * without searching for the end of the chain. */
+typedef struct {
+    AST* first;
+    AST* last;
+} chain_t;
+
+static void chain_bind(chain_t* chain, AST* var, AST* val)
+{
+    AST* let = Let(var, val, NULL);
+    if (chain->last == NULL)
+        chain->first = let;
+    else
+        let_set_body(chain->last, let);
+    chain->last = let;
 }
 
+static AST* chain_close(chain_t* chain, AST* body)
+{
+    if (chain->last == NULL)
+        return body;
+    let_set_body(chain->last, body);
+    return chain->first;
+}
+
+static AST* normalize_value(chain_t* chain, AST* tree);
+
 static AST* normalize_def(AST* tree)
 {
-    Tok name = { .value.text = def_name(tree) };
+    Tok name = { .value.text = { def_name(tree), strlen(def_name(tree)) } };
     return Def(&name, normalize(def_value(tree)));
 }
 
-static AST* normalize_fnapp(AST* tree)
+static AST* normalize_fnapp(chain_t* chain, AST* tree)
 {
-    AST* normalized = tree;
     AST* fn = fnapp_fn(tree);
-    /* Normalize the function */
+    AST* fntemp = NULL;
     if (!isatomic(fn)) {
-        AST* temp = TempVar();
-        fnapp_set_fn(tree, temp);
-        normalized = Let(temp, fn, tree);
+        fntemp = TempVar();
+        fnapp_set_fn(tree, fntemp);
     }
-    /* Normalize the function arguments */
-    vec_t temps;
-    vec_init(&temps);
-    vec_t* args = fnapp_args(tree);
-    for (int i = 0; i < vec_size(args); i++) {
-        AST* arg = (AST*)vec_at(args, i);
+    /* Each complex argument is bound to a temp in the scope of the ones
+     * before it, and the function in the scope of all of them */
+    for (size_t i = 0; i < fnapp_nargs(tree); i++) {
+        AST* arg = fnapp_arg(tree, i);
         if (!isatomic(arg)) {
             AST* temp = TempVar();
-            vec_push_back(&temps, Let(temp, arg, NULL));
-            vec_set(args, i, temp);
+            fnapp_set_arg(tree, i, temp);
+            chain_bind(chain, temp, arg);
         }
     }
-    /* Nest all the scopes and return the new form */
-    for (int i = vec_size(&temps); i > 0; i--) {
-        AST* let = (AST*)vec_at(&temps,i-1);
-        let_set_body(let, normalized);
-        normalized = let;
-    }
-    vec_deinit(&temps);
-    return normalized;
+    if (fntemp != NULL)
+        chain_bind(chain, fntemp, fn);
+    return tree;
 }
 
-static AST* normalize_if(AST* tree)
+static AST* normalize_if(chain_t* chain, AST* tree)
 {
     AST* cond   = normalize(ifexpr_cond(tree));
     AST* thenbr = normalize(ifexpr_then(tree));
     AST* elsebr = normalize(ifexpr_else(tree));
     if (!isatomic(cond)) {
         AST* temp = TempVar();
-        AST* body = IfExpr();
-        ifexpr_set_cond(body, temp);
-        ifexpr_set_then(body, thenbr);
-        ifexpr_set_else(body, elsebr);
-        tree = Let(temp, cond, body);
-    } else {
-        tree = IfExpr();
-        ifexpr_set_cond(tree, cond);
-        ifexpr_set_then(tree, thenbr);
-        ifexpr_set_else(tree, elsebr);
+        chain_bind(chain, temp, cond);
+        cond = temp;
     }
+    tree = IfExpr();
+    ifexpr_set_cond(tree, cond);
+    ifexpr_set_then(tree, thenbr);
+    ifexpr_set_else(tree, elsebr);
     return tree;
 }
 
@@ -94,39 +99,40 @@ static AST* normalize_func(AST* tree)
     return tree;
 }
 
-static AST* normalize_let(AST* tree)
+static AST* normalize_let(chain_t* chain, AST* tree)
 {
-    AST* var  = let_var(tree);
-    AST* val  = normalize(let_val(tree));
-    AST* body = normalize(let_body(tree));
-    /* Find the inner most let block */
-    if (val->type == AST_IF && isatomic(body)) {
-        tree = val;
-    } else if (!isconst(val)) {
-        AST* let = val;
-        while (let->type == AST_LET && let_body(let)->type == AST_LET)
-            let = let_body(let);
-        let_set_body(let, Let(var, let_body(let), body));
-        tree = let;
-    } else {
-        tree = Let(var, val, body);
+    /* Blocks are chains of lets thousands long, so they are walked rather
+     * than recursed into, with the bindings of each statement appended to
+     * the chain ahead of the statement itself */
+    for (; (tree != NULL) && (tree->type == AST_LET); tree = let_body(tree)) {
+        AST* last = chain->last;
+        AST* val  = normalize_value(chain, let_val(tree));
+        /* A conditional as the result of a block needs no name of its own */
+        if ((val->type == AST_IF) && (chain->last == last) && isatomic(let_body(tree)))
+            return val;
+        chain_bind(chain, let_var(tree), val);
     }
-    return tree;
+    return normalize_value(chain, tree);
 }
 
-AST* normalize(AST* tree)
+static AST* normalize_value(chain_t* chain, AST* tree)
 {
     if (NULL == tree)
         return tree;
     switch (tree->type)
     {
-        case AST_DEF:   tree = normalize_def(tree);   break;
-        case AST_FNAPP: tree = normalize_fnapp(tree); break;
-        case AST_IF:    tree = normalize_if(tree);    break;
-        case AST_FUNC:  tree = normalize_func(tree);  break;
-        case AST_LET:   tree = normalize_let(tree);   break;
+        case AST_DEF:   tree = normalize_def(tree);          break;
+        case AST_FNAPP: tree = normalize_fnapp(chain, tree); break;
+        case AST_IF:    tree = normalize_if(chain, tree);    break;
+        case AST_FUNC:  tree = normalize_func(tree);         break;
+        case AST_LET:   tree = normalize_let(chain, tree);   break;
         default: break;
     }
     return tree;
 }
 
+AST* normalize(AST* tree)
+{
+    chain_t chain = { NULL, NULL };
+    return chain_close(&chain, normalize_value(&chain, tree));
+}
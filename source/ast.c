@@ -1,60 +1,389 @@
 #include <sclpl.h>
 
+/* Node Arena
+ *
+ * Each top-level form is built in an arena of its own that is released as a
+ * whole once the form has been compiled. Nodes live in aligned blocks that
+ * never move, so the address of a node is stable, and the block a node sits
+ * in leads back to its arena and its index. String literals are copied into
+ * the arena, but names point into the symbol pool on the collected heap of
+ * the thread that parsed the form. A tree handed to another thread is only
+ * good for as long as that thread keeps its heap.
+ *
+ * With --trees=heap every node is instead an object on the collected heap
+ * that holds counted references to its children, with its arguments in a
+ * vector. Only the form's number, temps and string literals are kept in an
+ * arena. The counts are not atomic, so such trees never leave the thread
+ * that built them. Unless the collector runs with noregions, the nodes go in
+ * the region the driver opens and are released with the arena.
+ *****************************************************************************/
+#define AST_BLOCK_SIZE 4096
+#define AST_TEXT_SIZE  4096
+
+typedef struct ast_arena_t ast_arena_t;
+
+typedef struct {
+    ast_arena_t* arena;
+    /* Index of the first node in the block */
+    uint32_t base;
+    AST nodes[];
+} ast_block_t;
+
+#define AST_BLOCK_NODES ((AST_BLOCK_SIZE - sizeof(ast_block_t)) / sizeof(AST))
+
+struct ast_arena_t {
+    ast_block_t** blocks;
+    size_t nblocks;
+    uint32_t count;
+    uint32_t* args;
+    uint32_t nargs;
+    uint32_t argcap;
+    /* Arguments of the lists still being built, innermost last */
+    uint32_t* pending;
+    uint32_t npending;
+    uint32_t pendcap;
+    /* String literals are copied into chunks of text */
+    char** texts;
+    size_t ntexts;
+    char* textpos;
+    size_t textfree;
+    intptr_t temps;
+    /* Input the form was read from, NULL for stdin, and its position in it
+     * counting from 1 */
+    const char* file;
+    size_t form;
+};
+
+/* A node kept on the collected heap, the edges are the children that the
+ * arena reaches through child and the two indices in value */
+typedef struct {
+    AST node;
+    ast_arena_t* arena;
+    AST* edges[3];
+    vec_t args;
+} ast_obj_t;
+
+enum { EDGE_CHILD, EDGE_FIRST, EDGE_SECOND };
+
+/* Chosen once before anything is parsed */
+static bool Heap_Trees = false;
+
+/* The arena new nodes are allocated in */
+static THREAD_LOCAL ast_arena_t* Arena = NULL;
+
+/* Bytes taken from malloc for arenas by this thread */
+static THREAD_LOCAL size_t Arena_Bytes = 0;
+
+static ast_block_t* block_of(AST* tree)
+{
+    return (ast_block_t*)((uintptr_t)tree & ~(uintptr_t)(AST_BLOCK_SIZE - 1));
+}
+
+static ast_arena_t* arena_of(AST* tree)
+{
+    return Heap_Trees ? ((ast_obj_t*)tree)->arena : block_of(tree)->arena;
+}
+
+static ast_arena_t* arena_new(void)
+{
+    ast_arena_t* arena = (ast_arena_t*)calloc(1, sizeof(ast_arena_t));
+    assert(arena != NULL);
+    /* Index 0 is reserved for the missing node */
+    arena->count = 1;
+    return arena;
+}
+
+void ast_use_heap(bool enable)
+{
+    Heap_Trees = enable;
+}
+
+void ast_arena_begin(void)
+{
+    /* The previous arena now belongs to whoever holds its tree, a new one is
+     * started when the first node is allocated */
+    Arena = NULL;
+}
+
+void ast_arena_use(AST* tree)
+{
+    Arena = (tree != NULL) ? arena_of(tree) : NULL;
+}
+
+void ast_arena_free(AST* tree)
+{
+    ast_arena_t* arena = (tree != NULL) ? arena_of(tree) : Arena;
+    if (arena == NULL)
+        return;
+    /* Heap nodes outside of a region are left to the collector once nothing
+     * refers to them */
+    if (Heap_Trees)
+        gc_region_reset();
+    for (size_t i = 0; i < arena->nblocks; i++)
+        free(arena->blocks[i]);
+    for (size_t i = 0; i < arena->ntexts; i++)
+        free(arena->texts[i]);
+    free(arena->blocks);
+    free(arena->args);
+    free(arena->pending);
+    free(arena->texts);
+    free(arena);
+    if (Arena == arena)
+        Arena = NULL;
+}
+
+AST* ast_hold(AST* tree)
+{
+    /* Only the collected heap needs to know about references from memory it
+     * does not scan */
+    return Heap_Trees ? (AST*)gc_addref(tree) : tree;
+}
+
+void ast_release(AST* tree)
+{
+    if (Heap_Trees)
+        gc_delref(tree);
+}
+
+void ast_set_form(AST* tree, const char* file, size_t form)
+{
+    arena_of(tree)->file = file;
+    arena_of(tree)->form = form;
+}
+
+const char* ast_file(AST* tree)
+{
+    return arena_of(tree)->file;
+}
+
+size_t ast_form(AST* tree)
+{
+    return arena_of(tree)->form;
+}
+
+size_t ast_arena_bytes(void)
+{
+    return Arena_Bytes;
+}
+
+static AST* ast_at(AST* tree, uint32_t index)
+{
+    ast_arena_t* arena = block_of(tree)->arena;
+    if (index == 0)
+        return NULL;
+    index--;
+    return &(arena->blocks[index / AST_BLOCK_NODES]->nodes[index % AST_BLOCK_NODES]);
+}
+
+static uint32_t index_of(AST* tree)
+{
+    ast_block_t* block;
+    if (tree == NULL)
+        return 0;
+    block = block_of(tree);
+    return block->base + (uint32_t)(tree - block->nodes);
+}
+
+static uint32_t ref_of(AST* parent, AST* child)
+{
+    /* Indices only mean something within the one arena */
+    assert((child == NULL) || (block_of(child)->arena == block_of(parent)->arena));
+    return index_of(child);
+}
+
 static void ast_free(void* ptr)
 {
-    AST* ast = (AST*)ptr;
-    switch(ast->type) {
-        case AST_REQ:
-        case AST_IDENT:
-        case AST_STRING:
-        case AST_SYMBOL:
-            gc_delref(ast->value.text);
-            break;
-
-        case AST_DEF:
-            gc_delref(ast->value.def.name);
-            gc_delref(ast->value.def.value);
-            break;
-
-        case AST_IF:
-            gc_delref(ast->value.ifexpr.cond);
-            gc_delref(ast->value.ifexpr.bthen);
-            gc_delref(ast->value.ifexpr.belse);
-            break;
-
-        case AST_FUNC:
-            vec_deinit(&(ast->value.func.args));
-            gc_delref(ast->value.func.body);
-            break;
-
-        case AST_FNAPP:
-            gc_delref(ast->value.fnapp.fn);
-            vec_deinit(&(ast->value.fnapp.args));
-            break;
-
-        case AST_LET:
-            break;
-
-        case AST_TEMP:
-            break;
-
-        default:
-            break;
+    ast_obj_t* obj = (ast_obj_t*)ptr;
+    for (size_t i = 0; i < 3; i++)
+        gc_delref(obj->edges[i]);
+    vec_deinit(&(obj->args));
+}
+
+static void ast_trace(void* ptr, void (*visit)(void*))
+{
+    ast_obj_t* obj = (ast_obj_t*)ptr;
+    for (size_t i = 0; i < 3; i++)
+        visit(obj->edges[i]);
+    for (size_t i = 0; i < vec_size(&(obj->args)); i++)
+        visit(vec_at(&(obj->args), i));
+}
+
+static AST* ast_obj(ASTType type)
+{
+    static THREAD_LOCAL bool traced = false;
+    ast_obj_t* obj;
+    /* Each thread has a type table of its own */
+    if (!traced) {
+        gc_set_tracer(&ast_free, &ast_trace);
+        traced = true;
     }
+    obj = (ast_obj_t*)gc_region_alloc(sizeof(ast_obj_t), &ast_free);
+    memset(obj, 0, sizeof(ast_obj_t));
+    obj->node.type = type;
+    obj->arena = Arena;
+    vec_init(&(obj->args));
+    return &(obj->node);
 }
 
 static AST* ast(ASTType type)
 {
-    AST* tree = gc_alloc(sizeof(AST), &ast_free);
+    ast_arena_t* arena;
+    AST* tree;
+    if (Arena == NULL)
+        Arena = arena_new();
+    if (Heap_Trees)
+        return ast_obj(type);
+    arena = Arena;
+    if ((arena->count - 1) % AST_BLOCK_NODES == 0) {
+        ast_block_t* block;
+        if (0 != posix_memalign((void**)&block, AST_BLOCK_SIZE, AST_BLOCK_SIZE))
+            block = NULL;
+        assert(block != NULL);
+        assert(arena->count < UINT32_MAX - AST_BLOCK_NODES);
+        block->arena = arena;
+        block->base  = arena->count;
+        Arena_Bytes += AST_BLOCK_SIZE;
+        arena->blocks = (ast_block_t**)realloc(arena->blocks, (arena->nblocks + 1) * sizeof(ast_block_t*));
+        assert(arena->blocks != NULL);
+        arena->blocks[arena->nblocks++] = block;
+    }
+    tree = &(arena->blocks[arena->nblocks-1]->nodes[(arena->count - 1) % AST_BLOCK_NODES]);
+    arena->count++;
     memset(tree, 0, sizeof(AST));
     tree->type = type;
     return tree;
 }
 
+static uint32_t* edge_index(AST* tree, int edge)
+{
+    /* If expressions and lets keep their other two children in the same
+     * place of the union */
+    switch (edge) {
+        case EDGE_CHILD: return &(tree->child);
+        case EDGE_FIRST: return &(tree->value.let.value);
+        default:         return &(tree->value.let.body);
+    }
+}
+
+static AST* edge_get(AST* tree, int edge)
+{
+    if (Heap_Trees)
+        return ((ast_obj_t*)tree)->edges[edge];
+    return ast_at(tree, *edge_index(tree, edge));
+}
+
+static void edge_set(AST* tree, int edge, AST* child)
+{
+    if (Heap_Trees)
+        gc_swapref((void**)&(((ast_obj_t*)tree)->edges[edge]), child);
+    else
+        *edge_index(tree, edge) = ref_of(tree, child);
+}
+
+static char* arena_text(ast_arena_t* arena, const char* text, size_t len)
+{
+    char* str;
+    /* Strings are bumped off the newest chunk, long ones get one to
+     * themselves */
+    if (arena->textfree < len + 1) {
+        size_t size = (len + 1 > AST_TEXT_SIZE) ? (len + 1) : AST_TEXT_SIZE;
+        arena->texts = (char**)realloc(arena->texts, (arena->ntexts + 1) * sizeof(char*));
+        assert(arena->texts != NULL);
+        arena->textpos = (char*)malloc(size);
+        assert(arena->textpos != NULL);
+        arena->texts[arena->ntexts++] = arena->textpos;
+        arena->textfree = size;
+        Arena_Bytes += size;
+    }
+    str = arena->textpos;
+    memcpy(str, text, len);
+    str[len] = '\0';
+    arena->textpos  += len + 1;
+    arena->textfree -= len + 1;
+    return str;
+}
+
+static uint32_t* arena_reserve(uint32_t** items, uint32_t* cap, uint32_t count)
+{
+    if (count > *cap) {
+        uint32_t oldcap = *cap;
+        while (count > *cap)
+            *cap = (*cap == 0) ? 256 : (*cap * 2);
+        Arena_Bytes += (*cap - oldcap) * sizeof(uint32_t);
+        *items = (uint32_t*)realloc(*items, *cap * sizeof(uint32_t));
+        assert(*items != NULL);
+    }
+    return *items;
+}
+
+static void args_add(AST* tree, AST* arg)
+{
+    ast_arena_t* arena;
+    if (Heap_Trees) {
+        vec_push_back(&(((ast_obj_t*)tree)->args), arg);
+        return;
+    }
+    arena = block_of(tree)->arena;
+    /* Nested lists are finished before the list around them takes another
+     * argument, so the arguments of the list being built are always on top
+     * of the pending stack. Until args_end, first indexes that stack. */
+    arena_reserve(&(arena->pending), &(arena->pendcap), arena->npending + 1);
+    if (tree->value.args.count == 0)
+        tree->value.args.first = arena->npending;
+    assert(tree->value.args.first + tree->value.args.count == arena->npending);
+    arena->pending[arena->npending++] = ref_of(tree, arg);
+    tree->value.args.count++;
+}
+
+static void args_end(AST* tree)
+{
+    ast_arena_t* arena;
+    uint32_t count = tree->value.args.count;
+    if (Heap_Trees || (count == 0))
+        return;
+    arena = block_of(tree)->arena;
+    /* The finished list is copied to the side table in one piece */
+    arena_reserve(&(arena->args), &(arena->argcap), arena->nargs + count);
+    arena->npending -= count;
+    assert(tree->value.args.first == arena->npending);
+    memcpy(&(arena->args[arena->nargs]), &(arena->pending[arena->npending]), count * sizeof(uint32_t));
+    tree->value.args.first = arena->nargs;
+    arena->nargs += count;
+}
+
+static size_t args_count(AST* tree)
+{
+    if (Heap_Trees)
+        return vec_size(&(((ast_obj_t*)tree)->args));
+    return tree->value.args.count;
+}
+
+static AST* args_at(AST* tree, size_t index)
+{
+    if (Heap_Trees)
+        return (AST*)vec_at(&(((ast_obj_t*)tree)->args), index);
+    assert(index < tree->value.args.count);
+    return ast_at(tree, block_of(tree)->arena->args[tree->value.args.first + index]);
+}
+
+/* Node Constructors and Accessors
+ *****************************************************************************/
+static char* token_string(Tok* tok)
+{
+    /* Tokens only point into the source so the tree needs its own copy */
+    return arena_text(Arena, tok->value.text.ptr, tok->value.text.len);
+}
+
+static char* token_name(Tok* tok)
+{
+    /* Names are interned and live as long as the pool so are not counted */
+    return symbol_intern(tok->value.text.ptr, tok->value.text.len)->name;
+}
+
 AST* String(Tok* val)
 {
     AST* node = ast(AST_STRING);
-    node->value.text = (char*)gc_addref(val->value.text);
+    node->value.text = token_string(val);
     return node;
 }
 
@@ -68,7 +397,7 @@ char* string_value(AST* val)
 AST* Symbol(Tok* val)
 {
     AST* node = ast(AST_SYMBOL);
-    node->value.text = (char*)gc_addref(val->value.text);
+    node->value.text = token_name(val);
     return node;
 }
 
@@ -145,7 +474,7 @@ bool bool_value(AST* val)
 AST* Ident(Tok* val)
 {
     AST* node = ast(AST_IDENT);
-    node->value.text = (char*)gc_addref(val->value.text);
+    node->value.text = token_name(val);
     return node;
 }
 
@@ -159,7 +488,7 @@ char* ident_value(AST* val)
 AST* Require(Tok* name)
 {
     AST* node = ast(AST_REQ);
-    node->value.text = (char*)gc_addref(name->value.text);
+    node->value.text = token_name(name);
     return node;
 }
 
@@ -173,8 +502,8 @@ char* require_name(AST* req)
 AST* Def(Tok* name, AST* value)
 {
     AST* node = ast(AST_DEF);
-    node->value.def.name = (char*)gc_addref(name->value.text);
-    node->value.def.value = (AST*)gc_addref(value);
+    node->value.name = token_name(name);
+    edge_set(node, EDGE_CHILD, value);
     return node;
 }
 
@@ -182,14 +511,19 @@ char* def_name(AST* def)
 {
     assert(def != NULL);
     assert(def->type == AST_DEF);
-    return def->value.def.name;
+    return def->value.name;
 }
 
 AST* def_value(AST* def)
 {
     assert(def != NULL);
     assert(def->type == AST_DEF);
-    return def->value.def.value;
+    return edge_get(def, EDGE_CHILD);
+}
+
+void def_set_value(AST* def, AST* value)
+{
+    edge_set(def, EDGE_CHILD, value);
 }
 
 AST* IfExpr(void)
@@ -199,125 +533,155 @@ AST* IfExpr(void)
 
 AST* ifexpr_cond(AST* ifexpr)
 {
-    return ifexpr->value.ifexpr.cond;
+    return edge_get(ifexpr, EDGE_CHILD);
 }
 
 void ifexpr_set_cond(AST* ifexpr, AST* cond)
 {
-    ifexpr->value.ifexpr.cond = (AST*)gc_addref(cond);
+    edge_set(ifexpr, EDGE_CHILD, cond);
 }
 
 AST* ifexpr_then(AST* ifexpr)
 {
-    return ifexpr->value.ifexpr.bthen;
+    return edge_get(ifexpr, EDGE_FIRST);
 }
 
 void ifexpr_set_then(AST* ifexpr, AST* bthen)
 {
-    ifexpr->value.ifexpr.bthen = (AST*)gc_addref(bthen);
+    edge_set(ifexpr, EDGE_FIRST, bthen);
 }
 
 AST* ifexpr_else(AST* ifexpr)
 {
-    return ifexpr->value.ifexpr.belse;
+    return edge_get(ifexpr, EDGE_SECOND);
 }
 
 void ifexpr_set_else(AST* ifexpr, AST* belse)
 {
-    ifexpr->value.ifexpr.belse = (AST*)gc_addref(belse);
+    edge_set(ifexpr, EDGE_SECOND, belse);
 }
 
 AST* Func(void)
 {
-    AST* node = ast(AST_FUNC);
-    vec_init(&(node->value.func.args));
-    node->value.func.body = NULL;
-    return node;
+    return ast(AST_FUNC);
 }
 
-vec_t* func_args(AST* func)
+size_t func_nargs(AST* func)
 {
-    return &(func->value.func.args);
+    return args_count(func);
+}
+
+AST* func_arg(AST* func, size_t index)
+{
+    return args_at(func, index);
 }
 
 AST* func_body(AST* func)
 {
-    return func->value.func.body;
+    return edge_get(func, EDGE_CHILD);
 }
 
 void func_add_arg(AST* func, AST* arg)
 {
-    vec_push_back(func_args(func), gc_addref(arg));
+    args_add(func, arg);
+}
+
+void func_end_args(AST* func)
+{
+    args_end(func);
 }
 
 void func_set_body(AST* func, AST* body)
 {
-    func->value.func.body = (AST*)gc_addref(body);
+    edge_set(func, EDGE_CHILD, body);
 }
 
-AST* FnApp(AST* fnapp)
+AST* FnApp(AST* fn)
 {
     AST* node = ast(AST_FNAPP);
-    node->value.fnapp.fn = (AST*)gc_addref(fnapp);
-    vec_init(&(node->value.fnapp.args));
+    edge_set(node, EDGE_CHILD, fn);
     return node;
 }
 
 void fnapp_set_fn(AST* fnapp, AST* fn)
 {
-    AST* old = fnapp->value.fnapp.fn;
-    fnapp->value.fnapp.fn = (AST*)gc_addref(fn);
-    gc_delref(old);
+    edge_set(fnapp, EDGE_CHILD, fn);
 }
 
 AST* fnapp_fn(AST* fnapp)
 {
-    return fnapp->value.fnapp.fn;
+    return edge_get(fnapp, EDGE_CHILD);
+}
+
+size_t fnapp_nargs(AST* fnapp)
+{
+    return args_count(fnapp);
+}
+
+AST* fnapp_arg(AST* fnapp, size_t index)
+{
+    return args_at(fnapp, index);
 }
 
-vec_t* fnapp_args(AST* fnapp)
+void fnapp_set_arg(AST* fnapp, size_t index, AST* arg)
 {
-    return &(fnapp->value.fnapp.args);
+    if (Heap_Trees) {
+        vec_set(&(((ast_obj_t*)fnapp)->args), index, arg);
+        return;
+    }
+    assert(index < fnapp->value.args.count);
+    block_of(fnapp)->arena->args[fnapp->value.args.first + index] = ref_of(fnapp, arg);
 }
 
 void fnapp_add_arg(AST* fnapp, AST* arg)
 {
-    vec_push_back(&(fnapp->value.fnapp.args), gc_addref(arg));
+    args_add(fnapp, arg);
+}
+
+void fnapp_end_args(AST* fnapp)
+{
+    args_end(fnapp);
 }
 
 AST* Let(AST* temp, AST* val, AST* body)
 {
     AST* node = ast(AST_LET);
-    node->value.let.temp  = (AST*)gc_addref(temp);
-    node->value.let.value = (AST*)gc_addref(val);
-    node->value.let.body  = (AST*)gc_addref(body);
+    edge_set(node, EDGE_CHILD, temp);
+    edge_set(node, EDGE_FIRST, val);
+    edge_set(node, EDGE_SECOND, body);
     return node;
 }
 
 AST* let_var(AST* let)
 {
-    return let->value.let.temp;
+    return edge_get(let, EDGE_CHILD);
 }
 
 AST* let_val(AST* let)
 {
-    return let->value.let.value;
+    return edge_get(let, EDGE_FIRST);
+}
+
+void let_set_val(AST* let, AST* value)
+{
+    edge_set(let, EDGE_FIRST, value);
 }
 
 AST* let_body(AST* let)
 {
-    return let->value.let.body;
+    return edge_get(let, EDGE_SECOND);
 }
 
 void let_set_body(AST* let, AST* body)
 {
-    let->value.let.body = (AST*)gc_addref(body);
+    edge_set(let, EDGE_SECOND, body);
 }
 
 AST* TempVar(void)
 {
-    static intptr_t val = 0;
     AST* node = ast(AST_TEMP);
-    node->value.integer = val++;
+    /* Numbering restarts with each form so that its output does not depend
+     * on what was compiled before it or on which thread */
+    node->value.integer = Arena->temps++;
     return node;
 }
@@ -1,5 +1,19 @@
 #include <sclpl.h>
 
+static void codegen_float(FILE* file, double value)
+{
+    char text[32];
+    /* The shortest digits that read back as the same double, so that folded
+     * constants keep every bit of what the operation would have produced */
+    for (int digits = 15; digits <= 17; digits++) {
+        snprintf(text, sizeof(text), "%.*g", digits, value);
+        if (strtod(text, NULL) == value)
+            break;
+    }
+    /* Whole numbers still need to be double literals in C */
+    fprintf(file, "%s%s", text, (NULL == strpbrk(text, ".en")) ? ".0" : "");
+}
+
 void codegen(FILE* file, AST* tree)
 {
     switch(tree->type) {
@@ -20,7 +34,7 @@ void codegen(FILE* file, AST* tree)
             break;
 
         case AST_FLOAT:
-            fprintf(file, "%f", float_value(tree));
+            codegen_float(file, float_value(tree));
             break;
 
         case AST_BOOL:
@@ -62,10 +76,10 @@ void codegen(FILE* file, AST* tree)
 
         case AST_FUNC:
             fprintf(file,"(");
-            for (size_t i = 0; i < vec_size(func_args(tree)); i++) {
+            for (size_t i = 0; i < func_nargs(tree); i++) {
                 fprintf(file,"val ");
-                codegen(file, vec_at(func_args(tree), i));
-                if (i+1 < vec_size(func_args(tree)))
+                codegen(file, func_arg(tree, i));
+                if (i+1 < func_nargs(tree))
                     fprintf(file,", ");
             }
             fprintf(file,") {\n");
@@ -76,9 +90,9 @@ void codegen(FILE* file, AST* tree)
         case AST_FNAPP:
             codegen(file, fnapp_fn(tree));
             fprintf(file,"(");
-            for (size_t i = 0; i < vec_size(fnapp_args(tree)); i++) {
-                codegen(file, vec_at(fnapp_args(tree), i));
-                if (i+1 < vec_size(fnapp_args(tree)))
+            for (size_t i = 0; i < fnapp_nargs(tree); i++) {
+                codegen(file, fnapp_arg(tree, i));
+                if (i+1 < fnapp_nargs(tree))
                     fprintf(file,",");
             }
             fprintf(file,")");
@@ -0,0 +1,319 @@
+#include <sclpl.h>
+
+/* Constant Folding
+ *
+ * Runs over forms in A-normal form. Applications of the primitive operations
+ * to literals are computed here rather than at run time, and temps and names
+ * a let binds to a literal are replaced by the literal wherever they are
+ * used. A binding is dropped once every use of it has been replaced, unless
+ * it is the last of its block, which the code generator returns from.
+ * Nested expressions are recursed into, which the parser keeps within
+ * PASS_MAX_DEPTH levels.
+ *****************************************************************************/
+typedef enum {
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_LT, OP_GT, OP_EQ, OP_LTE, OP_GTE
+} op_t;
+
+static const struct {
+    const char* name;
+    ASTType operands;
+    op_t op;
+} Primitives[] = {
+    { "__iadd",     AST_INT,   OP_ADD }, { "__isub",     AST_INT,   OP_SUB },
+    { "__imul",     AST_INT,   OP_MUL }, { "__idiv",     AST_INT,   OP_DIV },
+    { "__imod",     AST_INT,   OP_MOD }, { "__ilt",      AST_INT,   OP_LT  },
+    { "__igt",      AST_INT,   OP_GT  }, { "__ieq",      AST_INT,   OP_EQ  },
+    { "__ilte",     AST_INT,   OP_LTE }, { "__igte",     AST_INT,   OP_GTE },
+    { "__fadd",     AST_FLOAT, OP_ADD }, { "__fsub",     AST_FLOAT, OP_SUB },
+    { "__fmul",     AST_FLOAT, OP_MUL }, { "__fdiv",     AST_FLOAT, OP_DIV },
+    { "__flt",      AST_FLOAT, OP_LT  }, { "__fgt",      AST_FLOAT, OP_GT  },
+    { "__feq",      AST_FLOAT, OP_EQ  }, { "__flte",     AST_FLOAT, OP_LTE },
+    { "__fgte",     AST_FLOAT, OP_GTE }, { "__char_lt",  AST_CHAR,  OP_LT  },
+    { "__char_gt",  AST_CHAR,  OP_GT  }, { "__char_eq",  AST_CHAR,  OP_EQ  },
+    { "__char_lte", AST_CHAR,  OP_LTE }, { "__char_gte", AST_CHAR,  OP_GTE },
+};
+
+#define NUM_PRIMITIVES (sizeof(Primitives)/sizeof(Primitives[0]))
+
+/* Primitives that the input has defined names of its own for at the top
+ * level. They cannot be folded in any later form of the same input. */
+static THREAD_LOCAL bool Redefined[NUM_PRIMITIVES];
+
+/* Integers are tagged with their low bit at run time, so only values that
+ * survive the shift are folded */
+#define INT_LIMIT (INTPTR_MAX / 2)
+
+typedef struct {
+    char* name;
+    /* The literal the name is bound to, NULL where it is shadowed */
+    AST* value;
+    /* Whether it is used where the literal cannot take its place */
+    bool needed;
+} binding_t;
+
+typedef struct {
+    /* Temps are unique within a form so are simply looked up by number */
+    binding_t* temps;
+    size_t ntemps;
+    binding_t* names;
+    size_t nnames;
+    size_t maxnames;
+} fold_t;
+
+static AST* fold_value(fold_t* f, AST* tree);
+static AST* fold_expr(fold_t* f, AST* tree);
+
+static bool isliteral(AST* tree)
+{
+    /* Characters are compared but not propagated, the code generator does
+     * not print them yet */
+    return (tree != NULL) && ((tree->type == AST_INT) ||
+        (tree->type == AST_FLOAT) || (tree->type == AST_BOOL));
+}
+
+static void bind(fold_t* f, AST* var, AST* value)
+{
+    binding_t* binding;
+    if (var->type == AST_TEMP) {
+        size_t temp = (size_t)temp_value(var);
+        if (value == NULL)
+            return;
+        if (temp >= f->ntemps) {
+            size_t ntemps = (f->ntemps == 0) ? 64 : f->ntemps;
+            while (ntemps <= temp)
+                ntemps *= 2;
+            f->temps = (binding_t*)realloc(f->temps, ntemps * sizeof(binding_t));
+            assert(f->temps != NULL);
+            memset(&(f->temps[f->ntemps]), 0, (ntemps - f->ntemps) * sizeof(binding_t));
+            f->ntemps = ntemps;
+        }
+        binding = &(f->temps[temp]);
+    } else {
+        if (f->nnames == f->maxnames) {
+            f->maxnames = (f->maxnames == 0) ? 16 : (f->maxnames * 2);
+            f->names = (binding_t*)realloc(f->names, f->maxnames * sizeof(binding_t));
+            assert(f->names != NULL);
+        }
+        binding = &(f->names[f->nnames++]);
+        binding->name = ident_value(var);
+    }
+    binding->value  = value;
+    binding->needed = false;
+}
+
+static binding_t* lookup(fold_t* f, AST* tree)
+{
+    if (tree->type == AST_TEMP) {
+        size_t temp = (size_t)temp_value(tree);
+        return ((temp < f->ntemps) && (f->temps[temp].value != NULL)) ? &(f->temps[temp]) : NULL;
+    }
+    /* Names are interned, so the same name is always the same pointer */
+    for (size_t i = f->nnames; i > 0; i--) {
+        if (f->names[i-1].name == ident_value(tree))
+            return &(f->names[i-1]);
+    }
+    return NULL;
+}
+
+static int primitive(fold_t* f, AST* fn)
+{
+    /* A local binding or argument of the same name hides the primitive */
+    if ((fn->type != AST_IDENT) || (lookup(f, fn) != NULL))
+        return -1;
+    for (size_t i = 0; i < NUM_PRIMITIVES; i++) {
+        if (0 == strcmp(Primitives[i].name, ident_value(fn)))
+            return Redefined[i] ? -1 : (int)i;
+    }
+    return -1;
+}
+
+static AST* fold_compare(op_t op, int order)
+{
+    Tok tok = { 0 };
+    switch (op) {
+        case OP_LT:  tok.value.boolean = (order <  0); break;
+        case OP_GT:  tok.value.boolean = (order >  0); break;
+        case OP_EQ:  tok.value.boolean = (order == 0); break;
+        case OP_LTE: tok.value.boolean = (order <= 0); break;
+        default:     tok.value.boolean = (order >= 0); break;
+    }
+    return Bool(&tok);
+}
+
+static AST* fold_int(op_t op, intptr_t lval, intptr_t rval)
+{
+    Tok tok = { 0 };
+    intptr_t result = 0;
+    bool overflow;
+    if ((lval > INT_LIMIT) || (lval < -INT_LIMIT) || (rval > INT_LIMIT) || (rval < -INT_LIMIT))
+        return NULL;
+    if (op >= OP_LT)
+        return fold_compare(op, (lval < rval) ? -1 : (lval > rval));
+    switch (op) {
+        case OP_ADD: overflow = __builtin_add_overflow(lval, rval, &result); break;
+        case OP_SUB: overflow = __builtin_sub_overflow(lval, rval, &result); break;
+        case OP_MUL: overflow = __builtin_mul_overflow(lval, rval, &result); break;
+        /* Dividing by zero is left to fail at run time */
+        case OP_DIV: overflow = (rval == 0); result = overflow ? 0 : (lval / rval); break;
+        default:     overflow = (rval == 0); result = overflow ? 0 : (lval % rval); break;
+    }
+    if (overflow || (result > INT_LIMIT) || (result < -INT_LIMIT))
+        return NULL;
+    tok.value.integer = result;
+    return Integer(&tok);
+}
+
+static AST* fold_float(op_t op, double lval, double rval)
+{
+    Tok tok = { 0 };
+    /* Nothing is ordered against NaN, and C has no % for doubles */
+    if (isnan(lval) || isnan(rval) || (op == OP_MOD) || ((op == OP_DIV) && (rval == 0.0)))
+        return NULL;
+    if (op >= OP_LT)
+        return fold_compare(op, (lval < rval) ? -1 : (lval > rval));
+    switch (op) {
+        case OP_ADD: tok.value.floating = lval + rval; break;
+        case OP_SUB: tok.value.floating = lval - rval; break;
+        case OP_MUL: tok.value.floating = lval * rval; break;
+        default:     tok.value.floating = lval / rval; break;
+    }
+    /* C has no literal for an infinity */
+    return isfinite(tok.value.floating) ? Float(&tok) : NULL;
+}
+
+static AST* fold_fnapp(fold_t* f, AST* tree)
+{
+    AST* fn = fnapp_fn(tree);
+    AST *lval, *rval, *result = NULL;
+    binding_t* binding;
+    int prim;
+    /* Calling a literal makes no sense, so a constant called as a function
+     * keeps its binding and only nested code is folded */
+    if ((fn->type == AST_TEMP) || (fn->type == AST_IDENT)) {
+        if (NULL != (binding = lookup(f, fn)))
+            binding->needed = true;
+    } else {
+        fnapp_set_fn(tree, fn = fold_value(f, fn));
+    }
+    for (size_t i = 0; i < fnapp_nargs(tree); i++)
+        fnapp_set_arg(tree, i, fold_expr(f, fnapp_arg(tree, i)));
+    if ((fnapp_nargs(tree) != 2) || ((prim = primitive(f, fn)) < 0))
+        return tree;
+    lval = fnapp_arg(tree, 0);
+    rval = fnapp_arg(tree, 1);
+    if ((lval->type != Primitives[prim].operands) || (rval->type != Primitives[prim].operands))
+        return tree;
+    if (lval->type == AST_INT)
+        result = fold_int(Primitives[prim].op, integer_value(lval), integer_value(rval));
+    else if (lval->type == AST_FLOAT)
+        result = fold_float(Primitives[prim].op, float_value(lval), float_value(rval));
+    else
+        result = fold_int(Primitives[prim].op, char_value(lval), char_value(rval));
+    return (result != NULL) ? result : tree;
+}
+
+static AST* fold_expr(fold_t* f, AST* tree)
+{
+    /* Where a value rather than a block is expected, a block that folds
+     * down to a single constant let is just its result */
+    tree = fold_value(f, tree);
+    if ((tree != NULL) && (tree->type == AST_LET) &&
+        isliteral(let_val(tree)) && isliteral(let_body(tree)))
+        tree = let_body(tree);
+    return tree;
+}
+
+static bool islet(AST* tree)
+{
+    return (tree != NULL) && (tree->type == AST_LET);
+}
+
+static AST* fold_let(fold_t* f, AST* tree)
+{
+    size_t scope = f->nnames;
+    size_t name = scope;
+    AST *let, *next;
+    AST* head = NULL;
+    AST* kept = NULL;
+    /* Blocks are walked rather than recursed into, see normalize_let */
+    for (let = tree; let != NULL; let = next) {
+        AST* value = fold_expr(f, let_val(let));
+        let_set_val(let, value);
+        bind(f, let_var(let), isliteral(value) ? value : NULL);
+        next = islet(let_body(let)) ? let_body(let) : NULL;
+        if (next == NULL)
+            let_set_body(let, fold_value(f, let_body(let)));
+    }
+    /* Only now is it known which constants are still used. Each name the
+     * block binds is on the stack in order, nested scopes having been
+     * popped. The last let stays, the code generator returns from it. */
+    for (let = tree; let != NULL; let = next) {
+        AST* var = let_var(let);
+        binding_t* binding = (var->type == AST_TEMP)
+            ? lookup(f, var) : &(f->names[name++]);
+        next = islet(let_body(let)) ? let_body(let) : NULL;
+        if ((next != NULL) && (binding != NULL) && (binding->value != NULL) && !binding->needed)
+            continue;
+        if (kept == NULL)
+            head = let;
+        else
+            let_set_body(kept, let);
+        kept = let;
+    }
+    f->nnames = scope;
+    return head;
+}
+
+static AST* fold_value(fold_t* f, AST* tree)
+{
+    binding_t* binding;
+    size_t scope;
+    if (NULL == tree)
+        return tree;
+    switch (tree->type) {
+        case AST_TEMP:
+        case AST_IDENT:
+            binding = lookup(f, tree);
+            return ((binding != NULL) && (binding->value != NULL)) ? binding->value : tree;
+
+        case AST_DEF:
+            for (size_t i = 0; i < NUM_PRIMITIVES; i++) {
+                if (0 == strcmp(Primitives[i].name, def_name(tree)))
+                    Redefined[i] = true;
+            }
+            def_set_value(tree, fold_expr(f, def_value(tree)));
+            break;
+
+        case AST_IF:
+            ifexpr_set_cond(tree, fold_value(f, ifexpr_cond(tree)));
+            ifexpr_set_then(tree, fold_value(f, ifexpr_then(tree)));
+            ifexpr_set_else(tree, fold_value(f, ifexpr_else(tree)));
+            break;
+
+        case AST_FUNC:
+            /* Arguments hide any names bound outside of the function */
+            scope = f->nnames;
+            for (size_t i = 0; i < func_nargs(tree); i++)
+                bind(f, func_arg(tree, i), NULL);
+            func_set_body(tree, fold_value(f, func_body(tree)));
+            f->nnames = scope;
+            break;
+
+        case AST_FNAPP: return fold_fnapp(f, tree);
+        case AST_LET:   return fold_let(f, tree);
+        default: break;
+    }
+    return tree;
+}
+
+AST* fold(AST* tree)
+{
+    fold_t f = { NULL, 0, NULL, 0, 0 };
+    /* Each input starts over with the primitives it has not redefined */
+    if (ast_form(tree) <= 1)
+        memset(Redefined, 0, sizeof(Redefined));
+    tree = fold_value(&f, tree);
+    free(f.temps);
+    free(f.names);
+    return tree;
+}
@@ -1,174 +1,430 @@
 #include <sclpl.h>
 
 typedef struct obj_t {
-    uintptr_t refs;
-    destructor_t destructor;
+    struct obj_t* next;
+    struct obj_t* prev;
+    uint32_t refs;
+    uint8_t type;
+    uint8_t sclass;
+    uint8_t flags;
 } obj_t;
 
-typedef struct hash_entry_t {
-    obj_t* object;
-    unsigned int hash;
-    struct hash_entry_t* next;
-} hash_entry_t;
+typedef struct page_t {
+    struct page_t* next;
+    struct page_t* prev;
+    obj_t* free;
+    size_t used;
+    size_t bump;
+    uint8_t sclass;
+    bool listed;
+} page_t;
 
 typedef struct {
     size_t size;
-    size_t bkt_count;
-    hash_entry_t** buckets;
-} hash_t;
+    obj_t head;
+} list_t;
 
-static void hash_set(hash_t* hash, hash_entry_t* entry);
+typedef struct chunk_t {
+    struct chunk_t* next;
+    size_t size;
+    size_t bump;
+} chunk_t;
+
+typedef struct {
+    size_t count;
+    size_t max;
+    obj_t** items;
+} array_t;
+
+typedef struct {
+    size_t mask;
+    unsigned int shift;
+    obj_t** slots;
+    uintptr_t min;
+    uintptr_t max;
+} table_t;
 
 /*****************************************************************************/
 
-#define NUM_PRIMES (sizeof(Primes)/sizeof(unsigned int))
+#define TOMBSTONE ((obj_t*)1)
 
-static unsigned int Primes[] = {
-    5, 13, 23, 53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593,
-    49157, 98317, 196613, 393241, 786433, 1572869, 3145739, 6291469,
-    12582917, 25165843, 50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741
-};
+/* Object flags used by cycle collection */
+#define OBJ_PURPLE 0x01
+#define OBJ_GRAY   0x02
+#define OBJ_WHITE  0x04
+#define OBJ_DEAD   0x08
+#define OBJ_REGION 0x10
 
-static unsigned int num_buckets(unsigned int idx) {
-    assert(idx < NUM_PRIMES);
-    return Primes[idx];
+static void list_init(list_t* list)
+{
+    list->size = 0;
+    list->head.next = &(list->head);
+    list->head.prev = &(list->head);
 }
 
-static void hash_init(hash_t* hash)
+static size_t list_size(list_t* list)
 {
-    hash->size      = 0;
-    hash->bkt_count = 0;
-    hash->buckets   = (hash_entry_t**)calloc(sizeof(hash_entry_t*), num_buckets(hash->bkt_count));
+    return list->size;
 }
 
-static void find_entry(hash_entry_t** parent, hash_entry_t** current, hash_entry_t* entry)
+static bool list_empty(list_t* list)
 {
-    while(*current != NULL) {
-        if (((*current)->hash == entry->hash) &&
-            ((*current)->object == entry->object))
-            break;
-        *parent  = *current;
-        *current = (*current)->next;
+    return (list->head.next == &(list->head));
+}
+
+static void list_add(list_t* list, obj_t* obj)
+{
+    obj->prev = &(list->head);
+    obj->next = list->head.next;
+    list->head.next->prev = obj;
+    list->head.next = obj;
+    list->size++;
+}
+
+static void list_del(list_t* list, obj_t* obj)
+{
+    obj->prev->next = obj->next;
+    obj->next->prev = obj->prev;
+    list->size--;
+}
+
+static void list_move(list_t* to, list_t* from)
+{
+    /* Transfer every object in from to the front of to without touching the
+     * individual nodes beyond the two ends of the chain */
+    if (!list_empty(from)) {
+        from->head.prev->next = to->head.next;
+        to->head.next->prev = from->head.prev;
+        to->head.next = from->head.next;
+        from->head.next->prev = &(to->head);
+        to->size += from->size;
+        list_init(from);
     }
 }
 
-static void rehash(hash_t* hash)
-{
-    unsigned int oldcount, i;
-    hash_entry_t** oldbuckets;
-    hash_entry_t *node, *entry;
-    if ((hash->bkt_count+1) < NUM_PRIMES) {
-        oldcount = hash->bkt_count++;
-        oldbuckets = hash->buckets;
-        hash->buckets = (hash_entry_t**)calloc(sizeof(hash_entry_t*), num_buckets(hash->bkt_count));
-        hash->size = 0;
-        /* Iterate over all of the old buckets */
-        for (i = 0; i < num_buckets(oldcount); i++) {
-            node = oldbuckets[i];
-            /* re-insert all entries in the bucket into the new bucket table */
-            while (node != NULL) {
-                entry = node;
-                node = entry->next;
-                hash_set(hash, entry);
-            }
+static size_t table_index(table_t* table, void* ptr)
+{
+    /* Fibonacci hashing keeps the well mixed high bits of the product */
+    return (size_t)((((uint64_t)(uintptr_t)ptr) * UINT64_C(0x9E3779B97F4A7C15)) >> table->shift);
+}
+
+static void table_init(table_t* table, list_t* list)
+{
+    size_t nslots = 16;
+    unsigned int bits = 4;
+    /* Keep the load factor at or below one half so probe chains stay short */
+    while (nslots < (2 * list_size(list))) {
+        nslots <<= 1;
+        bits++;
+    }
+    table->mask  = nslots - 1;
+    table->shift = 64 - bits;
+    table->slots = (obj_t**)calloc(nslots, sizeof(obj_t*));
+    table->min   = UINTPTR_MAX;
+    table->max   = 0;
+    for (obj_t* obj = list->head.next; obj != &(list->head); obj = obj->next) {
+        size_t index = table_index(table, obj+1);
+        if ((uintptr_t)(obj+1) < table->min)
+            table->min = (uintptr_t)(obj+1);
+        if ((uintptr_t)(obj+1) > table->max)
+            table->max = (uintptr_t)(obj+1);
+        while (table->slots[index] != NULL)
+            index = (index + 1) & table->mask;
+        table->slots[index] = obj;
+    }
+}
+
+static void table_deinit(table_t* table)
+{
+    free(table->slots);
+}
+
+static obj_t* table_take(table_t* table, void* ptr)
+{
+    size_t index;
+    obj_t* obj;
+    /* Most words on the stack are not object addresses at all so throw out
+     * anything misaligned or outside the span of the table before hashing */
+    if (((uintptr_t)ptr < table->min) || ((uintptr_t)ptr > table->max) ||
+        ((uintptr_t)ptr & (sizeof(void*)-1)))
+        return NULL;
+    index = table_index(table, ptr);
+    while ((obj = table->slots[index]) != NULL) {
+        if ((obj != TOMBSTONE) && ((void*)(obj+1) == ptr)) {
+            table->slots[index] = TOMBSTONE;
+            return obj;
         }
-        /* Free the old bucket table */
-        free(oldbuckets);
+        index = (index + 1) & table->mask;
     }
+    return NULL;
 }
 
-static uint64_t hash64(uint64_t key)
-{
-    key = (~key) + (key << 21);
-    key = key ^ (key >> 24);
-    key = (key + (key << 3)) + (key << 8);
-    key = key ^ (key >> 14);
-    key = (key + (key << 2)) + (key << 4);
-    key = key ^ (key >> 28);
-    key = key + (key << 31);
-    return key;
-}
-
-static size_t hash_size(hash_t* hash)
-{
-    return hash->size;
-}
-
-static void hash_set(hash_t* hash, hash_entry_t* entry)
-{
-    unsigned int index;
-    hash_entry_t *parent, *node, *deadite;
-    if (hash->size >= num_buckets(hash->bkt_count))
-        rehash(hash);
-    entry->hash = hash64((uint64_t)(entry->object));
-    index   = (entry->hash % num_buckets(hash->bkt_count));
-    parent  = NULL;
-    node    = hash->buckets[index];
-    deadite = NULL;
-    find_entry(&parent, &node, entry);
-    if ((parent == NULL) && (node == NULL)) {
-        hash->buckets[index] = entry;
-        entry->next = NULL;
-        hash->size++;
-    } else if (node == NULL) {
-        parent->next = entry;
-        entry->next = NULL;
-        hash->size++;
-    } else if (parent == NULL) {
-        deadite = node;
-        entry->next = deadite->next;
-        hash->buckets[index] = entry;
+static void array_push(array_t* array, obj_t* obj)
+{
+    if (array->count == array->max) {
+        array->max = (array->max == 0) ? 64 : (2 * array->max);
+        array->items = (obj_t**)realloc(array->items, array->max * sizeof(obj_t*));
+        assert(array->items != NULL);
+    }
+    array->items[array->count++] = obj;
+}
+
+/*****************************************************************************/
+
+#define PAGE_SIZE   ((size_t)64 * 1024)
+#define PAGE_START  ((sizeof(page_t) + 15) & ~(size_t)15)
+#define CHUNK_START ((sizeof(chunk_t) + 15) & ~(size_t)15)
+#define NUM_CLASSES (sizeof(Class_Sizes)/sizeof(size_t))
+#define LARGE_CLASS UINT8_MAX
+#define MAX_TYPES   UINT8_MAX
+
+/* Block sizes include the object header */
+static size_t Class_Sizes[] = {
+    32, 48, 64, 80, 96, 128, 192, 256, 384, 512
+};
+
+static THREAD_LOCAL gc_stats_t Stats;
+static THREAD_LOCAL page_t* Partial_Pages[NUM_CLASSES];
+static THREAD_LOCAL destructor_t Types[MAX_TYPES] = { NULL };
+static THREAD_LOCAL tracer_t Tracers[MAX_TYPES] = { NULL };
+static THREAD_LOCAL size_t Num_Types = 1;
+
+static uint8_t size_class(size_t size)
+{
+    uint8_t sclass;
+    for (sclass = 0; sclass < NUM_CLASSES; sclass++)
+        if (size <= Class_Sizes[sclass])
+            return sclass;
+    return LARGE_CLASS;
+}
+
+static uint8_t type_id(destructor_t destructor)
+{
+    uint8_t type;
+    /* There is one type per destructor and only a handful of destructors so
+     * a linear search is cheaper than anything smarter */
+    for (type = 0; type < Num_Types; type++)
+        if (Types[type] == destructor)
+            return type;
+    assert(Num_Types < MAX_TYPES);
+    Types[Num_Types] = destructor;
+    return Num_Types++;
+}
+
+static void page_link(page_t* page)
+{
+    page->prev = NULL;
+    page->next = Partial_Pages[page->sclass];
+    if (page->next != NULL)
+        page->next->prev = page;
+    Partial_Pages[page->sclass] = page;
+    page->listed = true;
+}
+
+static void page_unlink(page_t* page)
+{
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        Partial_Pages[page->sclass] = page->next;
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+    page->listed = false;
+}
+
+static page_t* page_new(uint8_t sclass)
+{
+    page_t* page = NULL;
+    if (0 != posix_memalign((void**)&page, PAGE_SIZE, PAGE_SIZE))
+        return NULL;
+    page->free   = NULL;
+    page->used   = 0;
+    page->bump   = PAGE_START;
+    page->sclass = sclass;
+    page_link(page);
+    return page;
+}
+
+static obj_t* slab_alloc(size_t size)
+{
+    uint8_t sclass = size_class(sizeof(obj_t) + size);
+    size_t* block;
+    page_t* page;
+    obj_t* obj;
+    if (sclass == LARGE_CLASS) {
+        /* Large blocks remember their size so the statistics can be kept */
+        block = (size_t*)malloc(sizeof(size_t) + sizeof(obj_t) + size);
+        *block = sizeof(obj_t) + size;
+        obj = (obj_t*)(block+1);
+        Stats.bytes_live += *block;
     } else {
-        deadite = node;
-        entry->next = deadite->next;
-        parent->next = entry;
+        page = Partial_Pages[sclass];
+        if (page == NULL)
+            page = page_new(sclass);
+        assert(page != NULL);
+        /* Reuse freed blocks before carving new ones from the tail */
+        if (page->free != NULL) {
+            obj = page->free;
+            page->free = obj->next;
+        } else {
+            obj = (obj_t*)((char*)page + page->bump);
+            page->bump += Class_Sizes[sclass];
+        }
+        page->used++;
+        if ((page->free == NULL) && (page->bump + Class_Sizes[sclass] > PAGE_SIZE))
+            page_unlink(page);
+        Stats.bytes_live += Class_Sizes[sclass];
     }
-    if (deadite != NULL)
-        free(deadite);
-}
-
-static hash_entry_t* hash_del(hash_t* hash, hash_entry_t* entry)
-{
-    unsigned int index;
-    hash_entry_t *parent, *node, *ret = NULL;
-    entry->hash = hash64((uint64_t)(entry->object));
-    index = (entry->hash % num_buckets(hash->bkt_count));
-    parent = NULL;
-    node = hash->buckets[index];
-    find_entry(&parent, &node, entry);
-    if (node != NULL) {
-        ret = node;
-        node = node->next;
-        if (parent != NULL)
-            parent->next = node;
-        else
-            hash->buckets[index] = node;
-        hash->size--;
+    if (Stats.bytes_live > Stats.bytes_peak)
+        Stats.bytes_peak = Stats.bytes_live;
+    assert(obj != NULL);
+    obj->sclass = sclass;
+    return obj;
+}
+
+static void slab_free(obj_t* obj)
+{
+    size_t* block;
+    page_t* page;
+    if (obj->sclass == LARGE_CLASS) {
+        block = (size_t*)obj - 1;
+        Stats.bytes_live -= *block;
+        free(block);
+    } else {
+        Stats.bytes_live -= Class_Sizes[obj->sclass];
+        page = (page_t*)((uintptr_t)obj & ~(PAGE_SIZE-1));
+        obj->next = page->free;
+        page->free = obj;
+        page->used--;
+        if (!page->listed)
+            page_link(page);
+        /* Hand empty pages back as a whole, keeping the last page of a class
+         * around so alternating alloc/free does not thrash the allocator */
+        if ((page->used == 0) && (page->next != NULL || page->prev != NULL)) {
+            page_unlink(page);
+            free(page);
+        }
     }
-    return ret;
 }
 
 /*****************************************************************************/
 
-static bool Shutdown;
-static void** Stack_Bottom;
-static hash_t Zero_Count_Table;
-static hash_t Multi_Ref_Table;
-static hash_t Working_Table;
+static THREAD_LOCAL bool Shutdown;
+static bool Fast_Exit = false;
+static bool Leak_Check = false;
+static THREAD_LOCAL void** Stack_Bottom;
+static THREAD_LOCAL list_t Zero_Count_Table;
+static THREAD_LOCAL list_t Multi_Ref_Table;
+static THREAD_LOCAL list_t Purple_Table;
+static THREAD_LOCAL list_t Working_Table;
+static THREAD_LOCAL table_t Working_Index;
+static size_t Collect_Min = 500;
+static double Collect_Growth = 1.0;
+static THREAD_LOCAL size_t Collect_Trigger = 500;
+static size_t Sweep_Step = 0;
+static uint64_t Sweep_Step_us = 0;
+static size_t Cycle_Min = 500;
+static size_t Cycle_Ratio = 8;
+static THREAD_LOCAL size_t Cycle_Next = 0;
+static THREAD_LOCAL list_t* Mark_List;
+static THREAD_LOCAL array_t Cycle_Set;
+static THREAD_LOCAL array_t Cycle_Stack;
+static bool Precise = false;
+static bool Regions = true;
+static collect_hook_t Collect_Hook = NULL;
+static THREAD_LOCAL bool Region_Open = false;
+static THREAD_LOCAL chunk_t* Region_Chunks = NULL;
+static THREAD_LOCAL chunk_t* Free_Chunks = NULL;
+static THREAD_LOCAL list_t Region_Table;
+static THREAD_LOCAL size_t Region_Bytes = 0;
+static THREAD_LOCAL size_t Region_Count = 0;
+static THREAD_LOCAL void*** Roots = NULL;
+static THREAD_LOCAL size_t Num_Roots = 0;
+static THREAD_LOCAL size_t Max_Roots = 0;
+static gc_stats_t Retired_Stats;
+static pthread_mutex_t Retired_Lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void gc_mark_region(void** start, void** end) {
-    hash_entry_t lookup = {0, 0, 0};
-    hash_entry_t* entry;
-    for (; start <= end; start++) {
-        lookup.object = *start;
-        entry = hash_del(&Working_Table, &lookup);
-        if (entry != NULL) {
-            hash_set(&Zero_Count_Table, entry);
-        }
+static void gc_options(const char* opts)
+{
+    char *copy, *save = NULL;
+    if (opts == NULL)
+        return;
+    /* Options are a comma separated list of flags and key=value pairs, for
+     * example SCLPL_GC="min=10000,growth=2.5,precise" */
+    copy = strdup(opts);
+    for (char* opt = strtok_r(copy, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        char* value = strchr(opt, '=');
+        if (value != NULL)
+            *(value++) = '\0';
+        if ((0 == strcmp(opt, "min")) && (value != NULL))
+            Collect_Min = strtoul(value, NULL, 0);
+        else if ((0 == strcmp(opt, "growth")) && (value != NULL))
+            Collect_Growth = strtod(value, NULL);
+        else if ((0 == strcmp(opt, "step")) && (value != NULL))
+            Sweep_Step = strtoul(value, NULL, 0);
+        else if ((0 == strcmp(opt, "step_us")) && (value != NULL))
+            Sweep_Step_us = strtoull(value, NULL, 0);
+        else if ((0 == strcmp(opt, "cycles")) && (value != NULL))
+            Cycle_Min = strtoul(value, NULL, 0);
+        else if (0 == strcmp(opt, "precise"))
+            Precise = true;
+        else if (0 == strcmp(opt, "noregions"))
+            Regions = false;
+        else if (0 == strcmp(opt, "leakcheck"))
+            Leak_Check = true;
+        else
+            fprintf(stderr, "Unknown SCLPL_GC option: '%s'\n", opt);
+    }
+    free(copy);
+}
+
+static uint64_t gc_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000u) + ((uint64_t)now.tv_nsec / 1000u);
+}
+
+static void gc_record_pause(uint64_t pause)
+{
+    size_t bucket = 0;
+    while ((bucket < GC_PAUSE_BUCKETS-1) && (pause >= ((uint64_t)1 << bucket)))
+        bucket++;
+    Stats.pauses[bucket]++;
+    Stats.pause_total_us += pause;
+    if (pause > Stats.pause_max_us)
+        Stats.pause_max_us = pause;
+}
+
+static void gc_pace(void)
+{
+    /* Let the zero count table grow in proportion to the heap that survived
+     * the last collection, but never by less than the configured minimum */
+    size_t live  = list_size(&Zero_Count_Table) + list_size(&Multi_Ref_Table) +
+                   list_size(&Purple_Table);
+    size_t allow = (size_t)(Collect_Growth * (double)live);
+    Collect_Trigger = list_size(&Zero_Count_Table) + ((allow > Collect_Min) ? allow : Collect_Min);
+}
+
+static void gc_mark_object(void* ptr) {
+    obj_t* obj = table_take(&Working_Index, ptr);
+    if (obj != NULL) {
+        obj->flags &= ~OBJ_WHITE;
+        list_del(&Working_Table, obj);
+        list_add(Mark_List, obj);
     }
 }
 
+static void gc_mark_region(void** start, void** end) {
+    for (; start <= end; start++)
+        gc_mark_object(*start);
+}
+
+static void gc_mark_roots(void) {
+    for (size_t i = 0; i < Num_Roots; i++)
+        gc_mark_object(*(Roots[i]));
+}
+
 static void gc_mark_stack(void) {
     void* stack_top = NULL;
     /* Determine which way the stack grows and scan it for pointers */
@@ -182,6 +438,11 @@ static void gc_mark_stack(void) {
 static void gc_mark(void) {
     jmp_buf env;
     volatile int noinline = 1;
+    /* Registered roots are all there is to scan in precise mode */
+    if (Precise) {
+        gc_mark_roots();
+        return;
+    }
     /* Flush Registers to Stack */
     if (noinline) {
         memset(&env, 0x55, sizeof(jmp_buf));
@@ -192,85 +453,308 @@ static void gc_mark(void) {
     (noinline ? gc_mark_stack : NULL)();
 }
 
-static void gc_sweep_table(hash_t* table) {
-    unsigned int i;
-    /* Delete all the entries in the hash */
-    for (i = 0; i < num_buckets(table->bkt_count); i++) {
-        hash_entry_t* node = table->buckets[i];
-      table->buckets[i] = NULL;
-        while (node != NULL) {
-            hash_entry_t* deadite = node;
-            node = node->next;
-            obj_t* obj = ((obj_t*)(deadite->object)-1);
-            if (obj->destructor != NULL)
-                obj->destructor(deadite->object);
-            free(deadite);
+static void gc_sweep_object(list_t* list) {
+    /* Destructors may move other objects between tables so always take the
+     * next victim from the front of the list */
+    obj_t* obj = list->head.next;
+    list_del(list, obj);
+    if (Types[obj->type] != NULL)
+        Types[obj->type]((void*)(obj+1));
+    slab_free(obj);
+    Stats.freed++;
+}
+
+static void gc_sweep_list(list_t* list) {
+    while (!list_empty(list))
+        gc_sweep_object(list);
+}
+
+static void gc_sweep_step(uint64_t start) {
+    size_t count = 0;
+    /* Nothing left in the working table after marking can be reached again
+     * so it is safe to release it a slice at a time between allocations.
+     * The clock is only read every so often to keep the check cheap. */
+    if (!Sweep_Step && !Sweep_Step_us) {
+        gc_sweep_list(&Working_Table);
+        return;
+    }
+    while (!list_empty(&Working_Table)) {
+        gc_sweep_object(&Working_Table);
+        count++;
+        if (Sweep_Step && (count >= Sweep_Step))
+            break;
+        if (Sweep_Step_us && ((count % 32) == 0) && (gc_now_us() - start >= Sweep_Step_us))
+            break;
+    }
+}
+
+/*****************************************************************************/
+
+static void gc_trace(obj_t* obj, void (*visit)(void*)) {
+    if (Tracers[obj->type] != NULL)
+        Tracers[obj->type]((void*)(obj+1), visit);
+}
+
+static void gc_mark_gray(void* ptr) {
+    if (ptr != NULL) {
+        obj_t* obj = ((obj_t*)ptr-1);
+        /* Remove the reference held by a candidate and pull the target into
+         * the candidate set if it is not there already */
+        assert(obj->refs > 0);
+        obj->refs--;
+        if (!(obj->flags & OBJ_GRAY)) {
+            obj->flags |= OBJ_GRAY;
+            array_push(&Cycle_Set, obj);
+        }
+    }
+}
+
+static void gc_mark_black(void* ptr) {
+    if (ptr != NULL) {
+        obj_t* obj = ((obj_t*)ptr-1);
+        obj->refs++;
+        if (obj->flags & OBJ_WHITE) {
+            list_del(&Working_Table, obj);
+            list_add(&Multi_Ref_Table, obj);
+        }
+        if (obj->flags & (OBJ_GRAY|OBJ_WHITE)) {
+            obj->flags &= ~(OBJ_GRAY|OBJ_WHITE);
+            array_push(&Cycle_Stack, obj);
+        }
+    }
+}
+
+static void gc_scan_black(obj_t* obj) {
+    /* Restore the counts of everything reachable from a surviving object */
+    obj->flags &= ~(OBJ_GRAY|OBJ_WHITE);
+    array_push(&Cycle_Stack, obj);
+    while (Cycle_Stack.count > 0)
+        gc_trace(Cycle_Stack.items[--Cycle_Stack.count], gc_mark_black);
+}
+
+static void gc_restore(void* ptr) {
+    if (ptr != NULL)
+        ((obj_t*)ptr-1)->refs++;
+}
+
+static void gc_collect_cycles(void) {
+    list_t pending;
+    obj_t* obj;
+    size_t i;
+    list_init(&pending);
+    /* A garbage cycle can only be left behind by a reference count that was
+     * decremented without reaching zero. Starting from those candidates,
+     * remove every reference held inside the reachable subgraph. The
+     * candidates stay linked where they are so the common case of finding
+     * everything alive never touches the lists. */
+    Cycle_Set.count = 0;
+    for (obj = Purple_Table.head.next; obj != &(Purple_Table.head); obj = obj->next) {
+        obj->flags |= OBJ_GRAY;
+        array_push(&Cycle_Set, obj);
+    }
+    for (i = 0; i < Cycle_Set.count; i++)
+        gc_trace(Cycle_Set.items[i], gc_mark_gray);
+    /* Anything still counted is referenced from outside the subgraph */
+    for (i = 0; i < Cycle_Set.count; i++) {
+        obj = Cycle_Set.items[i];
+        if ((obj->flags & OBJ_GRAY) && (obj->refs > 0))
+            gc_scan_black(obj);
+    }
+    /* Set the rest aside and give the stack a chance to claim them */
+    for (i = 0; i < Cycle_Set.count; i++) {
+        obj = Cycle_Set.items[i];
+        if (obj->flags & OBJ_GRAY) {
+            list_del((obj->flags & OBJ_PURPLE) ? &Purple_Table : &Multi_Ref_Table, obj);
+            list_add(&Working_Table, obj);
+            obj->flags = OBJ_WHITE;
         }
     }
-    free(table->buckets);
+    for (obj = Purple_Table.head.next; obj != &(Purple_Table.head); obj = obj->next)
+        obj->flags &= ~OBJ_PURPLE;
+    list_move(&Multi_Ref_Table, &Purple_Table);
+    if (!list_empty(&Working_Table)) {
+        Mark_List = &pending;
+        table_init(&Working_Index, &Working_Table);
+        gc_mark();
+        table_deinit(&Working_Index);
+        Mark_List = &Zero_Count_Table;
+        while (!list_empty(&pending)) {
+            obj = pending.head.next;
+            list_del(&pending, obj);
+            list_add(&Multi_Ref_Table, obj);
+            gc_scan_black(obj);
+        }
+    }
+    /* The rest is garbage held together by its own references. Put their
+     * counts back so the destructors can release them as usual, then run all
+     * of the destructors before freeing anything. */
+    for (obj = Working_Table.head.next; obj != &(Working_Table.head); obj = obj->next)
+        obj->flags = OBJ_DEAD;
+    for (obj = Working_Table.head.next; obj != &(Working_Table.head); obj = obj->next)
+        gc_trace(obj, gc_restore);
+    for (obj = Working_Table.head.next; obj != &(Working_Table.head); obj = obj->next)
+        if (Types[obj->type] != NULL)
+            Types[obj->type]((void*)(obj+1));
+    while (!list_empty(&Working_Table)) {
+        obj = Working_Table.head.next;
+        list_del(&Working_Table, obj);
+        slab_free(obj);
+        Stats.freed++;
+        Stats.cycle_freed++;
+    }
+    /* A handful of candidates can reach most of the heap so space the passes
+     * out by allocation volume to keep their cost proportional to it */
+    Cycle_Next = Stats.allocated + (Cycle_Ratio * Cycle_Set.count);
+    Stats.cycle_collections++;
 }
 
 void gc_init(void** stack_bottom)
 {
-    Stack_Bottom = stack_bottom;
-    hash_init(&Zero_Count_Table);
-    hash_init(&Multi_Ref_Table);
+    gc_options(getenv("SCLPL_GC"));
+    gc_thread_init(stack_bottom);
     atexit(gc_deinit);
+}
+
+void gc_thread_init(void** stack_bottom)
+{
+    /* Every thread has a heap of its own, objects are never shared */
+    Stack_Bottom = stack_bottom;
+    list_init(&Zero_Count_Table);
+    list_init(&Multi_Ref_Table);
+    list_init(&Purple_Table);
+    list_init(&Region_Table);
+    list_init(&Working_Table);
+    Mark_List = &Zero_Count_Table;
+    gc_pace();
     Shutdown = false;
 }
 
+static void gc_stats_add(gc_stats_t* total, gc_stats_t* stats)
+{
+    total->collections       += stats->collections;
+    total->allocated         += stats->allocated;
+    total->freed             += stats->freed;
+    total->cycle_collections += stats->cycle_collections;
+    total->cycle_freed       += stats->cycle_freed;
+    total->sweep_steps       += stats->sweep_steps;
+    total->region_allocated  += stats->region_allocated;
+    total->bytes_live        += stats->bytes_live;
+    total->zct_size          += stats->zct_size;
+    total->mrt_size          += stats->mrt_size;
+    total->pause_total_us    += stats->pause_total_us;
+    /* Threads peak at different times, so a sum would overstate the peak */
+    if (stats->bytes_peak > total->bytes_peak)
+        total->bytes_peak = stats->bytes_peak;
+    if (stats->pause_max_us > total->pause_max_us)
+        total->pause_max_us = stats->pause_max_us;
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++)
+        total->pauses[i] += stats->pauses[i];
+}
+
 void gc_deinit(void)
 {
+    gc_stats_t stats;
+    /* Keep the statistics of finished threads for whoever reports them */
+    gc_stats(&stats);
+    pthread_mutex_lock(&Retired_Lock);
+    gc_stats_add(&Retired_Stats, &stats);
+    pthread_mutex_unlock(&Retired_Lock);
+    /* Everything is about to go back to the OS anyway, so only walk the heap
+     * when asked to leave nothing behind for a leak checker */
+    if (Fast_Exit && !Leak_Check)
+        return;
     Shutdown = true;
-    gc_sweep_table(&Zero_Count_Table);
-    gc_sweep_table(&Multi_Ref_Table);
+    gc_sweep_list(&Working_Table);
+    gc_sweep_list(&Zero_Count_Table);
+    gc_sweep_list(&Multi_Ref_Table);
+    gc_sweep_list(&Purple_Table);
+    if (Leak_Check) {
+        gc_region_end();
+        while (Free_Chunks != NULL) {
+            chunk_t* chunk = Free_Chunks;
+            Free_Chunks = chunk->next;
+            free(chunk);
+        }
+        for (size_t i = 0; i < NUM_CLASSES; i++) {
+            while (Partial_Pages[i] != NULL) {
+                page_t* page = Partial_Pages[i];
+                page_unlink(page);
+                free(page);
+            }
+        }
+        free(Cycle_Set.items);
+        free(Cycle_Stack.items);
+        free(Roots);
+    }
+}
+
+static void gc_sweep(void) {
+    uint64_t start = gc_now_us();
+    gc_sweep_step(start);
+    gc_record_pause(gc_now_us() - start);
+    Stats.sweep_steps++;
 }
 
 void gc_collect(void) {
+    uint64_t start = gc_now_us();
+    uint64_t pause;
 #ifdef GC_DEBUG_MSGS
     printf("BEFORE - ZCT: %ld MRT: %ld TOT: %ld\n",
-        hash_size(&Zero_Count_Table),
-        hash_size(&Multi_Ref_Table),
-        hash_size(&Zero_Count_Table) + hash_size(&Multi_Ref_Table));
+        list_size(&Zero_Count_Table),
+        list_size(&Multi_Ref_Table),
+        list_size(&Zero_Count_Table) + list_size(&Multi_Ref_Table));
 #endif
-    Working_Table = Zero_Count_Table;
-    hash_init(&Zero_Count_Table);
+    /* The working table is needed again so finish any sweep in progress */
+    gc_sweep_list(&Working_Table);
+    if ((Cycle_Min > 0) && (list_size(&Purple_Table) >= Cycle_Min) &&
+        (Stats.allocated >= Cycle_Next))
+        gc_collect_cycles();
+    list_move(&Working_Table, &Zero_Count_Table);
+    table_init(&Working_Index, &Working_Table);
     gc_mark();
-    gc_sweep_table(&Working_Table);
+    table_deinit(&Working_Index);
+    gc_sweep_step(start);
+    gc_pace();
+    Stats.collections++;
+    pause = gc_now_us() - start;
+    gc_record_pause(pause);
+    if (Collect_Hook != NULL)
+        Collect_Hook(start, pause);
 #ifdef GC_DEBUG_MSGS
     printf("AFTER - ZCT: %ld MRT: %ld TOT: %ld\n\n",
-        hash_size(&Zero_Count_Table),
-        hash_size(&Multi_Ref_Table),
-        hash_size(&Zero_Count_Table) + hash_size(&Multi_Ref_Table));
+        list_size(&Zero_Count_Table),
+        list_size(&Multi_Ref_Table),
+        list_size(&Zero_Count_Table) + list_size(&Multi_Ref_Table));
 #endif
 }
 
 void* gc_alloc(size_t size, destructor_t destructor)
 {
-    hash_entry_t* entry = (hash_entry_t*)malloc(sizeof(hash_entry_t) + sizeof(obj_t) + size);
-    obj_t* p_obj = (obj_t*)(entry+1);
-    void* p_data = (void*)(p_obj+1);
-    entry->object = p_data;
-    p_obj->refs = 0;
-    p_obj->destructor = destructor;
-    hash_set(&Zero_Count_Table, entry);
-    if (hash_size(&Zero_Count_Table) >= 500)
+    obj_t* p_obj;
+    /* Collect before linking the new object so it can never be mistaken for
+     * garbage while only its header address is live. Unregistered locals may
+     * be holding anything in precise mode so wait for a safepoint there. */
+    if (!Precise && (list_size(&Zero_Count_Table) >= Collect_Trigger))
         gc_collect();
-    return p_data;
+    else if (!list_empty(&Working_Table))
+        gc_sweep();
+    p_obj = slab_alloc(size);
+    p_obj->refs = 0;
+    p_obj->type = type_id(destructor);
+    p_obj->flags = 0;
+    list_add(&Zero_Count_Table, p_obj);
+    Stats.allocated++;
+    return (void*)(p_obj+1);
 }
 
 void* gc_addref(void* ptr)
 {
-    hash_entry_t lookup = {0, 0, 0};
-    hash_entry_t* entry;
-    obj_t* obj = ((obj_t*)ptr-1);
-    if ((ptr != NULL) && !Shutdown) {
+    if ((ptr != NULL) && !Shutdown && !(((obj_t*)ptr-1)->flags & OBJ_REGION)) {
+        obj_t* obj = ((obj_t*)ptr-1);
         obj->refs++;
         if (obj->refs == 1) {
-            lookup.object = ptr;
-            entry = hash_del(&Zero_Count_Table, &lookup);
-            assert(entry != NULL);
-            hash_set(&Multi_Ref_Table, entry);
+            list_del(&Zero_Count_Table, obj);
+            list_add(&Multi_Ref_Table, obj);
         }
     }
     return ptr;
@@ -278,16 +762,21 @@ void* gc_addref(void* ptr)
 
 void gc_delref(void* ptr)
 {
-    hash_entry_t lookup = {0, 0, 0};
-    hash_entry_t* entry;
-    obj_t* obj = ((obj_t*)ptr-1);
-    if ((ptr != NULL) && !Shutdown) {
+    /* Dead members of a cycle are freed together regardless of their count */
+    if ((ptr != NULL) && !Shutdown && !(((obj_t*)ptr-1)->flags & (OBJ_DEAD|OBJ_REGION))) {
+        obj_t* obj = ((obj_t*)ptr-1);
+        assert(obj->refs > 0);
         obj->refs--;
         if (obj->refs == 0) {
-            lookup.object = ptr;
-            entry = hash_del(&Multi_Ref_Table, &lookup);
-            assert(entry != NULL);
-            hash_set(&Zero_Count_Table, entry);
+            list_del((obj->flags & OBJ_PURPLE) ? &Purple_Table : &Multi_Ref_Table, obj);
+            list_add(&Zero_Count_Table, obj);
+            obj->flags &= ~OBJ_PURPLE;
+        } else if (!(obj->flags & OBJ_PURPLE) && (Tracers[obj->type] != NULL)) {
+            /* This might have been the last reference from outside a cycle.
+             * Objects we cannot trace through can never close one. */
+            list_del(&Multi_Ref_Table, obj);
+            list_add(&Purple_Table, obj);
+            obj->flags |= OBJ_PURPLE;
         }
     }
 }
@@ -301,6 +790,155 @@ void gc_swapref(void** dest, void* newref)
 
 /*****************************************************************************/
 
+static chunk_t* chunk_new(size_t size)
+{
+    chunk_t* chunk;
+    /* Reuse the chunks of the last region for anything that fits */
+    if ((size <= PAGE_SIZE) && (Free_Chunks != NULL)) {
+        chunk = Free_Chunks;
+        Free_Chunks = chunk->next;
+    } else {
+        size = (size > PAGE_SIZE) ? size : PAGE_SIZE;
+        chunk = (chunk_t*)malloc(CHUNK_START + size);
+        assert(chunk != NULL);
+        chunk->size = size;
+    }
+    chunk->bump = CHUNK_START;
+    chunk->next = Region_Chunks;
+    Region_Chunks = chunk;
+    return chunk;
+}
+
+void gc_fast_exit(bool enable)
+{
+    Fast_Exit = enable;
+}
+
+void gc_region_begin(void)
+{
+    assert(!Region_Open);
+    Region_Open = Regions;
+}
+
+void* gc_region_alloc(size_t size, destructor_t destructor)
+{
+    chunk_t* chunk = Region_Chunks;
+    obj_t* obj;
+    if (!Region_Open)
+        return gc_alloc(size, destructor);
+    /* Keep blocks pointer aligned, the same as the slab pages do */
+    size = (sizeof(obj_t) + size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if ((chunk == NULL) || (chunk->bump + size > CHUNK_START + chunk->size))
+        chunk = chunk_new(size);
+    obj = (obj_t*)((char*)chunk + chunk->bump);
+    chunk->bump += size;
+    obj->refs  = 0;
+    obj->type  = type_id(destructor);
+    obj->flags = OBJ_REGION;
+    /* Only objects with a destructor need to be visited when the region is
+     * released, everything else simply disappears with its chunk */
+    if (destructor != NULL)
+        list_add(&Region_Table, obj);
+    Region_Bytes += size;
+    Region_Count++;
+    Stats.bytes_live += size;
+    if (Stats.bytes_live > Stats.bytes_peak)
+        Stats.bytes_peak = Stats.bytes_live;
+    Stats.allocated++;
+    Stats.region_allocated++;
+    return (void*)(obj+1);
+}
+
+void gc_region_reset(void)
+{
+    chunk_t* chunk;
+    /* Reference counts are not kept inside a region so destructors only
+     * release what the region's objects hold on the collected heap */
+    for (obj_t* obj = Region_Table.head.next; obj != &(Region_Table.head); obj = obj->next)
+        Types[obj->type]((void*)(obj+1));
+    list_init(&Region_Table);
+    while (Region_Chunks != NULL) {
+        chunk = Region_Chunks;
+        Region_Chunks = chunk->next;
+        if (chunk->size == PAGE_SIZE) {
+            chunk->next = Free_Chunks;
+            Free_Chunks = chunk;
+        } else {
+            free(chunk);
+        }
+    }
+    Stats.freed += Region_Count;
+    Stats.bytes_live -= Region_Bytes;
+    Region_Count = 0;
+    Region_Bytes = 0;
+}
+
+void gc_region_end(void)
+{
+    gc_region_reset();
+    Region_Open = false;
+}
+
+void gc_set_tracer(destructor_t destructor, tracer_t tracer)
+{
+    Tracers[type_id(destructor)] = tracer;
+}
+
+void gc_set_collect_hook(collect_hook_t hook)
+{
+    Collect_Hook = hook;
+}
+
+void gc_root(void** slot)
+{
+    if (Num_Roots == Max_Roots) {
+        Max_Roots = (Max_Roots == 0) ? 16 : (2 * Max_Roots);
+        Roots = (void***)realloc(Roots, Max_Roots * sizeof(void**));
+        assert(Roots != NULL);
+    }
+    Roots[Num_Roots++] = slot;
+}
+
+void gc_unroot(void** slot)
+{
+    assert((Num_Roots > 0) && (Roots[Num_Roots-1] == slot));
+    Num_Roots--;
+}
+
+void gc_safepoint(void)
+{
+    if (list_size(&Zero_Count_Table) >= Collect_Trigger)
+        gc_collect();
+    else if (!list_empty(&Working_Table))
+        gc_sweep();
+}
+
+void gc_stats(gc_stats_t* stats)
+{
+    *stats = Stats;
+    stats->zct_size = list_size(&Zero_Count_Table);
+    stats->mrt_size = list_size(&Multi_Ref_Table) + list_size(&Purple_Table);
+}
+
+size_t gc_peak_reset(size_t peak)
+{
+    /* Lets the peak be measured over a stretch of the run and the overall
+     * peak be put back afterwards */
+    size_t previous = Stats.bytes_peak;
+    Stats.bytes_peak = (peak > Stats.bytes_live) ? peak : Stats.bytes_live;
+    return previous;
+}
+
+void gc_stats_total(gc_stats_t* stats)
+{
+    gc_stats(stats);
+    pthread_mutex_lock(&Retired_Lock);
+    gc_stats_add(stats, &Retired_Stats);
+    pthread_mutex_unlock(&Retired_Lock);
+}
+
+/*****************************************************************************/
+
 int main(int argc, char** argv)
 {
     void* stack_bottom = NULL;
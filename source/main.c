@@ -2,91 +2,529 @@
 
 char* ARGV0;
 bool Verbose   = false;
+bool Timed     = false;
 char* Artifact = "bin";
+long Jobs      = 0;
+bool Pipelined = false;
+char* TracePath = NULL;
+bool HeapTrees = false;
 
 /* Driver Modes
+ *
+ * Each mode takes the forms of its input through the pass manager as far as
+ * its artifact requires. Between forms it offers the collector a safepoint,
+ * which is the only place a precise collection can run. The trees for a form
+ * are built in an arena that is released in one go once the form has been
+ * emitted.
  *****************************************************************************/
-static int emit_tokens(void) {
+static int emit_tokens(Parser* ctx, FILE* out) {
     Tok* token = NULL;
-    Parser* ctx = parser_new(NULL, stdin);
-    while(NULL != (token = gettoken(ctx)))
-        pprint_token(stdout, token, true);
+    while(NULL != (token = gettoken(ctx))) {
+        pprint_token(out, token, true);
+        gc_safepoint();
+    }
     return 0;
 }
 
-static int emit_ast(void) {
+static int emit_ast(Parser* ctx, FILE* out) {
     AST* tree = NULL;
-    Parser* ctx = parser_new(NULL, stdin);
-    while(NULL != (tree = toplevel(ctx)))
-        pprint_tree(stdout, tree, 0);
+    while(NULL != (tree = pass_transform(pass_parse(ctx), PASS_NORMALIZE))) {
+        pprint_tree(out, tree, 0);
+        fputc('\n', out);
+        ast_arena_free(tree);
+        gc_safepoint();
+    }
     return 0;
 }
 
-static int emit_anf(void) {
+static int emit_anf(Parser* ctx, FILE* out) {
     AST* tree = NULL;
-    Parser* ctx = parser_new(NULL, stdin);
-    while(NULL != (tree = toplevel(ctx)))
-        pprint_tree(stdout, normalize(tree), 0);
+    ctx->maxdepth = PASS_MAX_DEPTH;
+    /* Stops short of the optimizations, which are seen in the C */
+    while(NULL != (tree = pass_transform(pass_parse(ctx), PASS_FOLD))) {
+        pprint_tree(out, tree, 0);
+        fputc('\n', out);
+        ast_arena_free(tree);
+        gc_safepoint();
+    }
     return 0;
 }
 
-static int emit_csource(void) {
+static int emit_csource(Parser* ctx, FILE* out) {
     AST* tree = NULL;
-    Parser* ctx = parser_new(NULL, stdin);
-    while(NULL != (tree = normalize(toplevel(ctx))))
-        codegen(stdout, tree);
+    ctx->maxdepth = PASS_MAX_DEPTH;
+    while(NULL != (tree = pass_transform(pass_parse(ctx), PASS_CODEGEN))) {
+        pass_codegen(out, tree);
+        fputc('\n', out);
+        ast_arena_free(tree);
+        gc_safepoint();
+    }
     return 0;
 }
 
-static int emit_object(void) {
+static int emit_object(Parser* ctx, FILE* out) {
     return 0;
 }
 
-static int emit_staticlib(void) {
+static int emit_staticlib(Parser* ctx, FILE* out) {
     return 0;
 }
 
-static int emit_program(void) {
+static int emit_program(Parser* ctx, FILE* out) {
     return 0;
 }
 
+typedef struct {
+    const char* name;
+    /* Extension of the file written next to each input when there are
+     * several of them, modes without one write nothing */
+    const char* ext;
+    int (*emit)(Parser* ctx, FILE* out);
+} artifact_t;
+
+static artifact_t Artifacts[] = {
+    { "tok", ".tok", emit_tokens    },
+    { "ast", ".ast", emit_ast       },
+    { "anf", ".anf", emit_anf       },
+    { "src", ".c",   emit_csource   },
+    { "bin", NULL,   emit_program   },
+    { "lib", NULL,   emit_staticlib },
+};
+
+static artifact_t* Emit = NULL;
+
+static int compile(Parser* ctx, FILE* out) {
+    int status;
+    /* Trees on the heap are built in a region that each form releases */
+    if (HeapTrees)
+        gc_region_begin();
+    status = Emit->emit(ctx, out);
+    if (HeapTrees)
+        gc_region_end();
+    return status;
+}
+
+/* Pipelined Input
+ *
+ * With -p a single input is compiled to C by four threads at once. One lexes
+ * the input a buffer of tokens at a time, one parses top-level forms out of
+ * those buffers, one normalizes the forms and the main thread generates code
+ * for them in the order they were read. Each form is built in an arena of its
+ * own, so its nodes can be handed on without touching reference counts. The
+ * names in them still point into the symbol pool on the parsing thread's
+ * heap, so that heap has to outlive every stage, see stage_exit. The
+ * stages are joined by bounded queues with a single producer and a single
+ * consumer, which need nothing more than an acquire and a release per item.
+ *****************************************************************************/
+#define TOKEN_SLOTS 8
+#define FORM_SLOTS  64
+
+typedef struct {
+    /* Written only by the consumer */
+    size_t head;
+    char pad[64 - sizeof(size_t)];
+    /* Written only by the producer */
+    size_t tail;
+} ring_t;
+
+static struct {
+    Parser* ctx;
+    ring_t tokring;
+    TokBuf tokens[TOKEN_SLOTS];
+    ring_t parsed;
+    AST* parsed_forms[FORM_SLOTS];
+    ring_t normal;
+    AST* normal_forms[FORM_SLOTS];
+    /* Set when parsing fails so the lexer does not wait on a full queue */
+    int stop;
+    int status;
+    pthread_barrier_t done;
+} Pipe;
+
+static bool ring_reserve(ring_t* ring, size_t size, size_t* slot) {
+    while ((ring->tail - __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE)) == size) {
+        if (__atomic_load_n(&(Pipe.stop), __ATOMIC_ACQUIRE))
+            return false;
+        sched_yield();
+    }
+    *slot = ring->tail % size;
+    return true;
+}
+
+static void ring_publish(ring_t* ring) {
+    __atomic_store_n(&(ring->tail), ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static size_t ring_peek(ring_t* ring, size_t size) {
+    /* Producers always finish with an end marker, so this cannot hang */
+    while (__atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) == ring->head)
+        sched_yield();
+    return ring->head % size;
+}
+
+static void ring_release(ring_t* ring) {
+    __atomic_store_n(&(ring->head), ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void form_push(ring_t* ring, AST** forms, AST* tree) {
+    size_t slot = 0;
+    /* Only the lexer is ever stopped so this always gets a slot */
+    (void)ring_reserve(ring, FORM_SLOTS, &slot);
+    forms[slot] = tree;
+    ring_publish(ring);
+}
+
+static AST* form_pop(ring_t* ring, AST** forms) {
+    AST* tree = forms[ring_peek(ring, FORM_SLOTS)];
+    ring_release(ring);
+    return tree;
+}
+
+static void pipeline_fill(Parser* ctx, TokBuf* buf) {
+    /* There is only the one parser, whose tokens are in the shared ring */
+    size_t slot = ring_peek(&Pipe.tokring, TOKEN_SLOTS);
+    (void)ctx;
+    memcpy(buf, &(Pipe.tokens[slot]), sizeof(TokBuf));
+    ring_release(&Pipe.tokring);
+}
+
+static void* lex_stage(void* arg) {
+    TokBuf* buf;
+    size_t slot;
+    do {
+        if (!ring_reserve(&Pipe.tokring, TOKEN_SLOTS, &slot))
+            break;
+        buf = &(Pipe.tokens[slot]);
+        pass_lex(Pipe.ctx, buf);
+        ring_publish(&Pipe.tokring);
+    } while (buf->types[buf->count-1] != T_END_FILE);
+    return arg;
+}
+
+static void stage_exit(void) {
+    /* Names are interned in the pool of the thread that read them and used
+     * by the later stages, so no heap goes away before all are done */
+    pthread_barrier_wait(&Pipe.done);
+    gc_deinit();
+}
+
+static void* parse_stage(void* arg) {
+    void* stack_bottom = NULL;
+    jmp_buf onerror;
+    AST* tree;
+    gc_thread_init(&stack_bottom);
+    Pipe.ctx->onerror = &onerror;
+    if (0 == setjmp(onerror)) {
+        while (NULL != (tree = pass_parse(Pipe.ctx))) {
+            form_push(&Pipe.parsed, Pipe.parsed_forms, tree);
+            gc_safepoint();
+        }
+    } else {
+        ast_arena_free(NULL);
+        Pipe.status = 1;
+        __atomic_store_n(&(Pipe.stop), 1, __ATOMIC_RELEASE);
+    }
+    form_push(&Pipe.parsed, Pipe.parsed_forms, NULL);
+    stage_exit();
+    return arg;
+}
+
+static void* normalize_stage(void* arg) {
+    void* stack_bottom = NULL;
+    AST* tree;
+    gc_thread_init(&stack_bottom);
+    while (NULL != (tree = form_pop(&Pipe.parsed, Pipe.parsed_forms))) {
+        /* New nodes go in the arena of the form they belong to */
+        ast_arena_use(tree);
+        form_push(&Pipe.normal, Pipe.normal_forms, pass_transform(tree, PASS_CODEGEN));
+        gc_safepoint();
+    }
+    form_push(&Pipe.normal, Pipe.normal_forms, NULL);
+    stage_exit();
+    return arg;
+}
+
+static int compile_pipelined(Parser* ctx, FILE* out) {
+    void* (*stages[])(void*) = { lex_stage, parse_stage, normalize_stage };
+    pthread_t threads[3];
+    AST* tree;
+    memset(&Pipe, 0, sizeof(Pipe));
+    Pipe.ctx = ctx;
+    ctx->fill = pipeline_fill;
+    ctx->maxdepth = PASS_MAX_DEPTH;
+    pthread_barrier_init(&Pipe.done, NULL, 3);
+    for (size_t i = 0; i < 3; i++) {
+        if (0 != pthread_create(&threads[i], NULL, stages[i], NULL)) {
+            fprintf(stderr, "Unable to start a compiler thread\n");
+            exit(1);
+        }
+    }
+    while (NULL != (tree = form_pop(&Pipe.normal, Pipe.normal_forms))) {
+        pass_codegen(out, tree);
+        fputc('\n', out);
+        ast_arena_free(tree);
+        gc_safepoint();
+    }
+    pthread_barrier_wait(&Pipe.done);
+    for (size_t i = 0; i < 3; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&Pipe.done);
+    return Pipe.status;
+}
+
+/* Single Input
+ *****************************************************************************/
+
+static int compile_input(const char* path) {
+    /* Files are mapped and lexed in place, stdin has to be read in first */
+    Parser* ctx = (path == NULL) ? parser_new(NULL, stdin) : parser_open(path);
+    int status;
+    if (ctx == NULL) {
+        fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    gc_root((void**)&ctx);
+    /* Only C output has enough stages to be worth spreading out */
+    if (Pipelined && (Emit->emit == emit_csource))
+        status = compile_pipelined(ctx, stdout);
+    else
+        status = compile(ctx, stdout);
+    gc_unroot((void**)&ctx);
+    return status;
+}
+
+/* Multiple Inputs
+ *
+ * Files are handed out to a pool of worker threads, each with a heap, symbol
+ * pool and scanner of its own. Every file is compiled to an output file next
+ * to it and its diagnostics are held back so that they can be reported in
+ * the order the files were given.
+ *****************************************************************************/
+typedef struct {
+    const char* path;
+    char* errors;
+    size_t errlen;
+    int status;
+} job_t;
+
+static job_t* Job_Queue = NULL;
+static size_t Num_Jobs = 0;
+static size_t Next_Job = 0;
+static pthread_mutex_t Job_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* output_path(const char* path) {
+    /* foo.scl becomes foo.c, foo.ast and so on */
+    size_t len = strlen(path);
+    char* out;
+    if ((len > 4) && (0 == strcmp(path + len - 4, ".scl")))
+        len -= 4;
+    out = (char*)malloc(len + strlen(Emit->ext) + 1);
+    assert(out != NULL);
+    memcpy(out, path, len);
+    strcpy(out + len, Emit->ext);
+    return out;
+}
+
+static int compile_guarded(Parser* ctx, FILE* out) {
+    /* Kept apart from compile_job so that none of its locals are live across
+     * the longjmp back from a parse error */
+    jmp_buf onerror;
+    ctx->onerror = &onerror;
+    if (0 != setjmp(onerror)) {
+        ast_arena_free(NULL);
+        if (HeapTrees)
+            gc_region_end();
+        return 1;
+    }
+    return compile(ctx, out);
+}
+
+static void compile_job(job_t* job) {
+    char* outpath = (Emit->ext != NULL) ? output_path(job->path) : NULL;
+    FILE* errors = open_memstream(&(job->errors), &(job->errlen));
+    FILE* out = NULL;
+    Parser* ctx = parser_open(job->path);
+    assert(errors != NULL);
+    job->status = 1;
+    if (ctx == NULL) {
+        fprintf(errors, "Unable to open '%s': %s\n", job->path, strerror(errno));
+    } else if ((outpath != NULL) && (NULL == (out = fopen(outpath, "w")))) {
+        fprintf(errors, "Unable to create '%s': %s\n", outpath, strerror(errno));
+    } else {
+        gc_root((void**)&ctx);
+        ctx->errors = errors;
+        job->status = compile_guarded(ctx, out);
+        gc_unroot((void**)&ctx);
+    }
+    if (out != NULL) {
+        fclose(out);
+        /* Do not leave half an output behind for a build to pick up */
+        if (job->status != 0)
+            remove(outpath);
+    }
+    fclose(errors);
+    free(outpath);
+}
+
+static void* compile_worker(void* arg) {
+    void* stack_bottom = NULL;
+    gc_thread_init(&stack_bottom);
+    for (;;) {
+        size_t next;
+        pthread_mutex_lock(&Job_Lock);
+        next = Next_Job++;
+        pthread_mutex_unlock(&Job_Lock);
+        if (next >= Num_Jobs)
+            break;
+        compile_job(&Job_Queue[next]);
+        gc_safepoint();
+    }
+    gc_deinit();
+    return arg;
+}
+
+static int compile_files(size_t nfiles, char** files, size_t nthreads) {
+    pthread_t* threads;
+    int status = 0;
+    if (nthreads == 0)
+        nthreads = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    if ((nthreads == 0) || (nthreads > nfiles))
+        nthreads = nfiles;
+    Job_Queue = (job_t*)calloc(nfiles, sizeof(job_t));
+    threads   = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+    assert((Job_Queue != NULL) && (threads != NULL));
+    Num_Jobs = nfiles;
+    for (size_t i = 0; i < nfiles; i++)
+        Job_Queue[i].path = files[i];
+    for (size_t i = 0; i < nthreads; i++) {
+        if (0 != pthread_create(&threads[i], NULL, compile_worker, NULL)) {
+            fprintf(stderr, "Unable to start a compiler thread\n");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < nfiles; i++) {
+        fwrite(Job_Queue[i].errors, 1, Job_Queue[i].errlen, stderr);
+        free(Job_Queue[i].errors);
+        status |= Job_Queue[i].status;
+    }
+    free(threads);
+    free(Job_Queue);
+    return (status != 0);
+}
+
+/* Statistics
+ *****************************************************************************/
+static void print_gc_stats(void) {
+    gc_stats_t stats;
+    gc_stats_total(&stats);
+    fprintf(stderr, "gc: %zu collections, %zu objects allocated, %zu freed\n",
+        stats.collections, stats.allocated, stats.freed);
+    fprintf(stderr, "gc: %zu cycle passes, %zu objects freed from cycles\n",
+        stats.cycle_collections, stats.cycle_freed);
+    fprintf(stderr, "gc: %zu incremental sweep steps\n", stats.sweep_steps);
+    fprintf(stderr, "gc: %zu objects allocated in regions\n", stats.region_allocated);
+    fprintf(stderr, "gc: %zu bytes live, %zu bytes peak per thread, ZCT: %zu MRT: %zu\n",
+        stats.bytes_live, stats.bytes_peak, stats.zct_size, stats.mrt_size);
+    fprintf(stderr, "gc: %llu us total pause, %llu us longest pause\n",
+        (unsigned long long)stats.pause_total_us,
+        (unsigned long long)stats.pause_max_us);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats.pauses[i] > 0)
+            fprintf(stderr, "gc:   < %8llu us: %zu\n", 1ull << i, stats.pauses[i]);
+    }
+}
+
+static void print_pass_stats(void) {
+    pass_report(stderr);
+}
+
 /* Main Routine and Usage
  *****************************************************************************/
 void usage(void) {
     fprintf(stderr, "%s\n",
-        "Usage: sclpl [options...] [-A artifact] [file...]\n"
+        "Usage: sclpl [options...] [-A artifact] [-j jobs] [file...]\n"
         "\n-A<artifact> Emit the given type of artifact"
+        "\n-d<pass>     Disable the given compiler pass"
+        "\n-e<pass>     Enable the given compiler pass"
         "\n-h           Print help information"
-        "\n-v           Enable verbose status messages");
+        "\n-j<jobs>     Compile up to this many files at once (default: one per CPU)"
+        "\n-p           Lex, parse, normalize and generate C for one file on separate threads"
+        "\n-T           Report the time and memory spent in each compiler pass"
+        "\n-v           Enable verbose status messages"
+        "\n--trace=<file> Write a timeline of the compile as Chrome trace events"
+        "\n--trees=<heap|arena> Keep syntax trees on the collected heap or in arenas (default)"
+        "\n\nWith more than one file the output for each is written next to it.");
     exit(1);
 }
 
+static void long_option(char* opt) {
+    if (0 == strncmp(opt, "trace=", 6) && opt[6])
+        TracePath = opt + 6;
+    else if (0 == strcmp(opt, "trees=heap"))
+        HeapTrees = true;
+    else if (0 == strcmp(opt, "trees=arena"))
+        HeapTrees = false;
+    else
+        usage();
+}
+
 int user_main(int argc, char **argv) {
     /* Option parsing */
     OPTBEGIN {
         case 'A': Artifact = EOPTARG(usage()); break;
+        case 'd': if (!pass_enable(EOPTARG(usage()), false)) usage(); break;
+        case 'e': if (!pass_enable(EOPTARG(usage()), true)) usage(); break;
+        case 'j': Jobs = strtol(EOPTARG(usage()), NULL, 0); break;
+        case 'p': Pipelined = true; break;
+        case 'T': Timed = true; break;
         case 'v': Verbose = true; break;
+        OPTLONG:  long_option(OPTLONGARG()); break;
         default:  usage();
     } OPTEND;
 
-    /* Execute the main compiler process */
+    if (Jobs < 0)
+        usage();
 
-    if (0 == strcmp("tok", Artifact)) {
-        return emit_tokens();
-    } else if (0 == strcmp("ast", Artifact)) {
-        return emit_ast();
-    } else if (0 == strcmp("anf", Artifact)) {
-        return emit_anf();
-    } else if (0 == strcmp("src", Artifact)) {
-        return emit_csource();
-    } else if (0 == strcmp("bin", Artifact)) {
-        return emit_program();
-    } else if (0 == strcmp("lib", Artifact)) {
-        return emit_staticlib();
-    } else {
+    /* Reference counts are kept per thread, so trees on the collected heap
+     * cannot be passed between pipeline stages */
+    if (HeapTrees && Pipelined) {
+        fprintf(stderr, "--trees=heap cannot be combined with -p\n");
+        return 1;
+    }
+    ast_use_heap(HeapTrees);
+
+    /* The process is about to exit so leave the heap to the OS */
+    gc_fast_exit(true);
+
+    /* Report on memory behavior once everything else is done */
+    if (Verbose)
+        atexit(print_gc_stats);
+    if (Timed) {
+        pass_timing(true);
+        atexit(print_pass_stats);
+    }
+    if (TracePath != NULL) {
+        if (!trace_open(TracePath)) {
+            fprintf(stderr, "Unable to create '%s': %s\n", TracePath, strerror(errno));
+            return 1;
+        }
+        atexit(trace_close);
+    }
+
+    /* Execute the main compiler process */
+    for (size_t i = 0; i < sizeof(Artifacts)/sizeof(Artifacts[0]); i++) {
+        if (0 == strcmp(Artifacts[i].name, Artifact))
+            Emit = &Artifacts[i];
+    }
+    if (Emit == NULL) {
         fprintf(stderr, "Unknonwn artifact type: '%s'\n\n", Artifact);
         usage();
     }
-    return 1;
+    if (argc > 1)
+        return compile_files((size_t)argc, argv, (size_t)Jobs);
+    else
+        return compile_input((argc == 1) ? argv[0] : NULL);
 }
 
@@ -99,4 +99,8 @@ static inline char* __getopt(int* p_argc, char*** p_argv) {
 #define OPTLONG \
     case '-'
 
+/* Get the text of the current long option, e.g. "foo=bar" for --foo=bar. The
+ * rest of the argument is consumed. */
+#define OPTLONGARG() (brk_ = 1, &argv[0][1])
+
 #endif
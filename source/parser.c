@@ -8,25 +8,21 @@
 
 /* Private Declarations
  *****************************************************************************/
-// Sentinel EOF Token
-Tok tok_eof = { NULL, 0, 0, T_END_FILE, {0} };
-
 // Grammar Routines
 static AST* require(Parser* p);
 static AST* definition(Parser* p);
 static AST* expression(Parser* p);
-static AST* if_stmnt(Parser* p);
 static AST* function(Parser* p);
+static AST* function_head(Parser* p);
 static AST* literal(Parser* p);
-static AST* expr_block(Parser* p);
+static AST* nested(Parser* p, bool func);
 static AST* token_to_tree(Tok* tok);
-static AST* func_app(Parser* p, AST* fn);
 static void optional_type(Parser* p);
 
 // Parsing Routines
 static void parser_free(void* obj);
 static void fetch(Parser* parser);
-static Tok* peek(Parser* parser);
+static TokType peek(Parser* parser);
 static bool parser_eof(Parser* parser);
 static void parser_resume(Parser* parser);
 static void error(Parser* parser, const char* text);
@@ -39,6 +35,8 @@ static Tok* expect(Parser* parser, TokType type);
 AST* toplevel(Parser* p)
 {
     AST* ret = NULL;
+    /* Every form gets an arena of its own */
+    ast_arena_begin();
     if (!match(p, T_END_FILE)) {
         if (accept(p, T_REQUIRE))
             ret = require(p);
@@ -52,16 +50,17 @@ AST* toplevel(Parser* p)
 
 static AST* definition(Parser* p)
 {
-    Tok* id = expect(p, T_ID);
+    /* The token is overwritten by the next one accepted so keep a copy */
+    Tok id = *expect(p, T_ID);
     AST* expr;
-    if (peek(p)->type == T_LPAR) {
+    if (peek(p) == T_LPAR) {
         expr = function(p);
     } else {
         optional_type(p);
         expr = expression(p);
         expect(p, T_END);
     }
-    return Def(id, expr);
+    return Def(&id, expr);
 }
 
 static AST* require(Parser* p)
@@ -73,66 +72,41 @@ static AST* require(Parser* p)
 
 static AST* expression(Parser* p)
 {
-    AST* expr = NULL;
-    if (accept(p, T_LPAR)) {
-        expr = expression(p);
-        expect(p, T_RPAR);
-    } else if (accept(p, T_IF)) {
-        expr = if_stmnt(p);
-    } else if (accept(p, T_FN)) {
-        expr = function(p);
-    } else if (match(p, T_ID)) {
-        expr = Ident(expect(p,T_ID));
-    } else {
-        expr = literal(p);
-    }
-    /* Check if this is a function application */
-    if (peek(p)->type == T_LPAR) {
-        expr = func_app(p, expr);
-    }
-    return expr;
+    return nested(p, false);
 }
 
-static AST* if_stmnt(Parser* p)
+static AST* function(Parser* p)
 {
-    AST* ifexpr = IfExpr();
-    ifexpr_set_cond( ifexpr, expression(p) );
-    accept(p, T_THEN);
-    ifexpr_set_then( ifexpr, expr_block(p) );
-    if (accept(p, T_ELSE))
-        ifexpr_set_else( ifexpr, expr_block(p) );
-    expect(p,T_END);
-    return ifexpr;
+    return nested(p, true);
 }
 
-static AST* function(Parser* p)
+static AST* function_head(Parser* p)
 {
     AST* func = Func();
     expect(p, T_LPAR);
-    while(peek(p)->type != T_RPAR) {
+    while(peek(p) != T_RPAR) {
         func_add_arg(func, Ident(expect(p,T_ID)));
         optional_type(p);
-        if(peek(p)->type != T_RPAR)
+        if(peek(p) != T_RPAR)
             expect(p, T_COMMA);
     }
     expect(p, T_RPAR);
+    func_end_args(func);
     optional_type(p);
-    func_set_body(func, expr_block(p));
-    expect(p, T_END);
     return func;
 }
 
 static AST* literal(Parser* p)
 {
     AST* ret = NULL;
-    Tok* tok = peek(p);
-    switch (tok->type) {
+    TokType type = peek(p);
+    switch (type) {
         case T_BOOL:
         case T_CHAR:
         case T_STRING:
         case T_INT:
         case T_FLOAT:
-            ret = token_to_tree(expect(p, tok->type));
+            ret = token_to_tree(expect(p, type));
             break;
         default:
             error(p, "Expected a literal");
@@ -140,30 +114,220 @@ static AST* literal(Parser* p)
     return ret;
 }
 
-static AST* expr_block(Parser* p)
+/* Nested Expressions
+ *
+ * Expressions, blocks, ifs, functions and applications nest inside each other
+ * to any depth, so rather than recursing they are parsed with an explicit
+ * stack kept in the parser. Each frame is a construct that is waiting on the
+ * value of the expression or block being parsed inside of it.
+ *****************************************************************************/
+typedef enum {
+    P_PAREN,    /* ( expr ) */
+    P_IF_COND,  /* if expr then ... */
+    P_IF_THEN,  /* if ... then block [else] ... end */
+    P_IF_ELSE,  /* if ... else block end */
+    P_FN,       /* fn (args) block end */
+    P_FUNC,     /* def name(args) block end */
+    P_APP,      /* fn(expr, ...) */
+    P_BLOCK,    /* expr expr ... */
+    P_DEF,      /* def name expr; inside a block */
+    P_DEF_FUNC, /* def name(args) ... end inside a block */
+} pstate_t;
+
+typedef struct {
+    pstate_t state;
+    /* The tree being built, or the first let of a block, held until the
+     * frame is popped as the collector does not look in here */
+    AST* node;
+    /* The last let of a block */
+    AST* last;
+    /* The name of a definition inside a block */
+    TokValue name;
+} pframe_t;
+
+/* What to do next with the input or the value just parsed */
+enum { BEGIN_EXPR, BEGIN_BLOCK, BEGIN_ITEM, END_PRIMARY, END_VALUE };
+
+static pframe_t* push(Parser* p, pstate_t state, AST* node)
 {
-    AST* block = NULL;
-    vec_t exprs;
-    vec_init(&exprs);
-    /* Build all expressions into let forms with no bodies */
-    do {
-        if (accept(p, T_DEF)) {
-            AST* def = definition(p);
-            Tok name = { .value.text = def_name(def) };
-            vec_push_back(&exprs, Let(Ident(&name), def_value(def), NULL));
-        } else {
-            vec_push_back(&exprs, Let(TempVar(), expression(p), NULL));
-        }
-    } while(!match(p, T_END) && !match(p, T_ELSE));
-    /* Now nest all of the let forms making sure that the last one returns
-     * it's definition as its body */
-    for (int i = vec_size(&exprs); i > 0; i--) {
-        AST* let = (AST*)vec_at(&exprs,i-1);
-        let_set_body(let, (block == NULL) ? let_var(let) : block);
-        block = let;
+    pframe_t* frame;
+    if ((p->maxdepth > 0) && (p->nframes == p->maxdepth))
+        error(p, "Expression nested too deeply");
+    if (p->nframes == p->maxframes) {
+        p->maxframes = (p->maxframes == 0) ? 64 : (p->maxframes * 2);
+        p->frames = realloc(p->frames, p->maxframes * sizeof(pframe_t));
+        assert(p->frames != NULL);
+    }
+    frame = &((pframe_t*)p->frames)[p->nframes++];
+    frame->state = state;
+    frame->node  = ast_hold(node);
+    frame->last  = NULL;
+    return frame;
+}
+
+static void pop(Parser* p)
+{
+    p->nframes--;
+    ast_release(((pframe_t*)p->frames)[p->nframes].node);
+}
+
+static int block_add(Parser* p, pframe_t* block, AST* let, AST** value)
+{
+    /* Each expression of a block is a let form that is the body of the one
+     * before it, the last one returns its own variable */
+    if (block->last == NULL)
+        block->node = ast_hold(let);
+    else
+        let_set_body(block->last, let);
+    block->last = let;
+    if (!match(p, T_END) && !match(p, T_ELSE))
+        return BEGIN_ITEM;
+    let_set_body(let, let_var(let));
+    *value = block->node;
+    pop(p);
+    return END_VALUE;
+}
+
+static AST* nested(Parser* p, bool func)
+{
+    AST* value = NULL;
+    int next = BEGIN_EXPR;
+    pframe_t* frame;
+    /* Frames left behind by a parse error are simply dropped */
+    p->nframes = 0;
+    if (func) {
+        push(p, P_FUNC, function_head(p));
+        next = BEGIN_BLOCK;
+    }
+    for (;;) switch (next) {
+        case BEGIN_EXPR:
+            if (accept(p, T_LPAR)) {
+                push(p, P_PAREN, NULL);
+            } else if (accept(p, T_IF)) {
+                push(p, P_IF_COND, IfExpr());
+            } else if (accept(p, T_FN)) {
+                push(p, P_FN, function_head(p));
+                next = BEGIN_BLOCK;
+            } else if (match(p, T_ID)) {
+                value = Ident(expect(p,T_ID));
+                next = END_PRIMARY;
+            } else {
+                value = literal(p);
+                next = END_PRIMARY;
+            }
+            break;
+
+        case BEGIN_BLOCK:
+            push(p, P_BLOCK, NULL);
+            next = BEGIN_ITEM;
+            break;
+
+        case BEGIN_ITEM:
+            next = BEGIN_EXPR;
+            if (accept(p, T_DEF)) {
+                frame = push(p, P_DEF, NULL);
+                frame->name = expect(p, T_ID)->value;
+                if (peek(p) == T_LPAR) {
+                    frame->state = P_DEF_FUNC;
+                    push(p, P_FUNC, function_head(p));
+                    next = BEGIN_BLOCK;
+                } else {
+                    optional_type(p);
+                }
+            }
+            break;
+
+        case END_PRIMARY:
+            /* A primary expression may be applied, but only once */
+            next = END_VALUE;
+            if (peek(p) == T_LPAR) {
+                value = FnApp(value);
+                expect(p, T_LPAR);
+                if (peek(p) != T_RPAR) {
+                    push(p, P_APP, value);
+                    next = BEGIN_EXPR;
+                } else {
+                    expect(p, T_RPAR);
+                }
+            }
+            break;
+
+        case END_VALUE:
+            if (p->nframes == 0)
+                return value;
+            frame = &((pframe_t*)p->frames)[p->nframes-1];
+            switch (frame->state) {
+                case P_PAREN:
+                    expect(p, T_RPAR);
+                    pop(p);
+                    next = END_PRIMARY;
+                    break;
+
+                case P_IF_COND:
+                    ifexpr_set_cond(frame->node, value);
+                    accept(p, T_THEN);
+                    frame->state = P_IF_THEN;
+                    next = BEGIN_BLOCK;
+                    break;
+
+                case P_IF_THEN:
+                case P_IF_ELSE:
+                    if (frame->state == P_IF_THEN) {
+                        ifexpr_set_then(frame->node, value);
+                        if (accept(p, T_ELSE)) {
+                            frame->state = P_IF_ELSE;
+                            next = BEGIN_BLOCK;
+                            break;
+                        }
+                    } else {
+                        ifexpr_set_else(frame->node, value);
+                    }
+                    expect(p, T_END);
+                    value = frame->node;
+                    pop(p);
+                    next = END_PRIMARY;
+                    break;
+
+                case P_FN:
+                case P_FUNC:
+                    func_set_body(frame->node, value);
+                    expect(p, T_END);
+                    value = frame->node;
+                    pop(p);
+                    /* Only anonymous functions can be applied in place */
+                    next = (frame->state == P_FN) ? END_PRIMARY : END_VALUE;
+                    break;
+
+                case P_APP:
+                    fnapp_add_arg(frame->node, value);
+                    if (peek(p) != T_RPAR)
+                        expect(p, T_COMMA);
+                    if (peek(p) != T_RPAR) {
+                        next = BEGIN_EXPR;
+                    } else {
+                        expect(p, T_RPAR);
+                        fnapp_end_args(frame->node);
+                        value = frame->node;
+                        pop(p);
+                    }
+                    break;
+
+                case P_BLOCK:
+                    next = block_add(p, frame, Let(TempVar(), value, NULL), &value);
+                    break;
+
+                case P_DEF:
+                case P_DEF_FUNC: {
+                    Tok name = { .value = frame->name };
+                    if (frame->state == P_DEF)
+                        expect(p, T_END);
+                    pop(p);
+                    next = block_add(p, frame-1, Let(Ident(&name), value, NULL), &value);
+                    break;
+                }
+            }
+            break;
     }
-    vec_deinit(&exprs);
-    return block;
 }
 
 static AST* token_to_tree(Tok* tok)
@@ -179,19 +343,6 @@ static AST* token_to_tree(Tok* tok)
     }
 }
 
-static AST* func_app(Parser* p, AST* fn)
-{
-    AST* app = FnApp(fn);
-    expect(p,T_LPAR);
-    while (peek(p)->type != T_RPAR) {
-        fnapp_add_arg(app, expression(p));
-        if (peek(p)->type != T_RPAR)
-            expect(p, T_COMMA);
-    }
-    expect(p,T_RPAR);
-    return app;
-}
-
 static void optional_type(Parser* p)
 {
     if (accept(p, T_COLON)) {
@@ -209,7 +360,7 @@ static void optional_type(Parser* p)
 
 /* Parsing Routines
  *****************************************************************************/
-Parser* parser_new(char* prompt, FILE* input)
+static Parser* parser_alloc(char* prompt, FILE* input)
 {
     Parser* parser  = (Parser*)gc_alloc(sizeof(Parser), &parser_free);
     parser->line    = NULL;
@@ -217,68 +368,222 @@ Parser* parser_new(char* prompt, FILE* input)
     parser->lineno  = 0;
     parser->input   = input;
     parser->prompt  = prompt;
-    parser->tok     = NULL;
+    memset(&(parser->tok), 0, sizeof(Tok));
+    parser->tokens.index = 0;
+    parser->tokens.count = 0;
+    parser->data    = NULL;
+    parser->size    = 0;
+    parser->mapped  = false;
+    parser->scanner = NULL;
+    parser->errors  = stderr;
+    parser->onerror = NULL;
+    parser->frames  = NULL;
+    parser->nframes = 0;
+    parser->maxframes = 0;
+    parser->maxdepth = 0;
+    parser->path    = NULL;
+    parser->lines   = NULL;
+    parser->nlines  = 0;
+    parser->lastline = 0;
+    parser->fill    = lexer_fill;
+    parser->forms   = 0;
+    return parser;
+}
+
+Parser* parser_new(char* prompt, FILE* input)
+{
+    Parser* parser = parser_alloc(prompt, input);
+    size_t capacity = 4096, nread;
+    /* Tokens point into the input so read all of it up front, leaving room
+     * for the two NUL bytes the lexer needs at the end */
+    parser->data = (char*)malloc(capacity);
+    while (0 < (nread = fread(parser->data + parser->size, 1, capacity - parser->size - 2, input))) {
+        parser->size += nread;
+        if (capacity - parser->size - 2 == 0) {
+            capacity *= 2;
+            parser->data = (char*)realloc(parser->data, capacity);
+        }
+    }
+    assert(parser->data != NULL);
+    assert(parser->size <= UINT32_MAX);
+    parser->data[parser->size]   = '\0';
+    parser->data[parser->size+1] = '\0';
+    lexer_init(parser);
+    return parser;
+}
+
+Parser* parser_open(const char* path)
+{
+    Parser* parser;
+    FILE* input;
+    struct stat st;
+    size_t tail;
+    int fd = open(path, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) < 0)) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    /* Token positions are kept as 32-bit offsets */
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+        close(fd);
+        errno = EFBIG;
+        return NULL;
+    }
+    /* Map the file privately so the lexer can scan it in place. The NUL bytes
+     * it needs at the end come from the zero filled rest of the last page, so
+     * only fall back to reading the file when that page is too full. */
+    tail = (size_t)st.st_size % (size_t)sysconf(_SC_PAGESIZE);
+    if ((tail == 0) || (tail + 2 > (size_t)sysconf(_SC_PAGESIZE))) {
+        input = fdopen(fd, "r");
+        parser = parser_new(NULL, input);
+        parser->input = NULL;
+        parser->path  = path;
+        fclose(input);
+        return parser;
+    }
+    parser = parser_alloc(NULL, NULL);
+    parser->size = (size_t)st.st_size;
+    parser->data = mmap(NULL, parser->size + 2, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (parser->data == MAP_FAILED) {
+        parser->data = NULL;
+        return NULL;
+    }
+    parser->mapped = true;
+    parser->path   = path;
+    lexer_init(parser);
     return parser;
 }
 
 static void parser_free(void* obj)
 {
     Parser* parser = (Parser*)obj;
-    if ((NULL != parser->tok) && (&tok_eof != parser->tok)) {
-        gc_delref(parser->tok);
-    }
     if (parser->line != NULL)
         free(parser->line);
+    free(parser->lines);
+    free(parser->frames);
+    lexer_deinit(parser);
+    if (parser->mapped)
+        munmap(parser->data, parser->size + 2);
+    else
+        free(parser->data);
+}
+
+/* Source Locations
+ *
+ * Tokens only carry the offset at which they start. The first time a line
+ * and column are asked for, the start of every line is recorded in one pass
+ * over the input. Lookups are a binary search, though consecutive lookups
+ * usually land on the same line as the last one and skip even that.
+ *****************************************************************************/
+static void parser_lines(Parser* parser)
+{
+    size_t capacity = 1024;
+    const char* pos = parser->data;
+    const char* end = parser->data + parser->size;
+    parser->lines = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    parser->lines[parser->nlines++] = 0;
+    while (NULL != (pos = memchr(pos, '\n', end - pos))) {
+        pos++;
+        if (parser->nlines == capacity) {
+            capacity *= 2;
+            parser->lines = (uint32_t*)realloc(parser->lines, capacity * sizeof(uint32_t));
+        }
+        parser->lines[parser->nlines++] = (uint32_t)(pos - parser->data);
+    }
+    assert(parser->lines != NULL);
+}
+
+static bool on_line(Parser* parser, size_t line, uint32_t offset)
+{
+    return ((parser->lines[line] <= offset) &&
+            ((line+1 == parser->nlines) || (offset < parser->lines[line+1])));
+}
+
+void parser_locate(Parser* parser, uint32_t offset, Tok* tok)
+{
+    size_t line = parser->lastline;
+    if (parser->lines == NULL)
+        parser_lines(parser);
+    if (on_line(parser, line, offset)) {
+        /* Same line as the last lookup */
+    } else if ((line+1 < parser->nlines) && on_line(parser, line+1, offset)) {
+        line++;
+    } else {
+        size_t lo = 0, hi = parser->nlines;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (parser->lines[mid] <= offset)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        line = lo;
+    }
+    parser->lastline = line;
+    tok->file = (parser->path != NULL) ? parser->path : "<stdin>";
+    tok->line = line + 1;
+    tok->col  = offset - parser->lines[line] + 1;
 }
 
 static void fetch(Parser* parser)
 {
-    parser->tok = gettoken(parser);
-    if (NULL == parser->tok)
-        parser->tok = &tok_eof;
+    TokBuf* buf = &(parser->tokens);
+    /* Once the end of the file is buffered it is never consumed */
+    if ((buf->count > 0) && (buf->types[buf->count-1] == T_END_FILE))
+        buf->index = buf->count-1;
+    else
+        parser->fill(parser, buf);
 }
 
-static Tok* peek(Parser* parser)
+static TokType peek(Parser* parser)
 {
-    if (NULL == parser->tok)
+    if (parser->tokens.index == parser->tokens.count)
         fetch(parser);
-    return parser->tok;
+    return parser->tokens.types[parser->tokens.index];
 }
 
 static bool parser_eof(Parser* parser)
 {
-    return (peek(parser)->type == T_END_FILE);
+    return (peek(parser) == T_END_FILE);
 }
 
 static void parser_resume(Parser* parser)
 {
-    if ((NULL != parser->tok) && (&tok_eof != parser->tok)) {
-        gc_delref(parser->tok);
-        parser->tok = NULL;
-    }
     /* We ignore the rest of the current line and attempt to start parsing
      * again on the next line */
+    parser->tokens.index = parser->tokens.count;
     fetchline(parser);
 }
 
 static void error(Parser* parser, const char* text)
 {
-    Tok* tok = peek(parser);
-    fprintf(stderr, "<file>:%zu:%zu:Error: %s\n", tok->line, tok->col, text);
+    Tok tok;
+    /* Report the position of the token that could not be parsed */
+    peek(parser);
+    parser_locate(parser, parser->tokens.offsets[parser->tokens.index], &tok);
+    fprintf(parser->errors, "%s:%zu:%zu:Error: %s\n", tok.file, tok.line, tok.col, text);
+    /* Drivers compiling several files at once carry on with the next one */
+    if (parser->onerror != NULL)
+        longjmp(*(parser->onerror), 1);
     exit(1);
 }
 
 static bool match(Parser* parser, TokType type)
 {
-    return (peek(parser)->type == type);
+    return (peek(parser) == type);
 }
 
 static Tok* accept(Parser* parser, TokType type)
 {
-    Tok* tok = peek(parser);
-    if (tok->type == type) {
-        gc_swapref((void**)&(parser->tok), NULL);
-        return tok;
+    TokBuf* buf = &(parser->tokens);
+    if (peek(parser) == type) {
+        /* Unpack the token into the parser's slot for the grammar to use */
+        parser->tok.type  = type;
+        parser->tok.value = buf->values[buf->index];
+        buf->index++;
+        return &(parser->tok);
     }
     return NULL;
 }
@@ -0,0 +1,200 @@
+#include <sclpl.h>
+
+/* Pass Manager
+ *
+ * Every top-level form is taken through the passes in the order they are
+ * listed below. Passes that transform a tree have a run function and are
+ * applied by pass_transform, the rest are driven by the compiler modes. With
+ * timing on each pass records its wall time, the objects it allocates on the
+ * collected heap, the arena memory it takes for trees and the highest the
+ * collected heap grows while it runs. The totals are shared by all threads.
+ * When a trace is being written each pass also adds a span to it for every
+ * form it handles.
+ *****************************************************************************/
+typedef struct {
+    const char* name;
+    /* Transforms a form, passes without one are driven by the caller */
+    AST* (*run)(AST* tree);
+    bool enabled;
+    bool optional;
+    /* Another pass whose output this one expects, it is skipped without it */
+    PassId needs;
+    uint64_t calls;
+    uint64_t ns;
+    uint64_t allocs;
+    uint64_t tree_bytes;
+    uint64_t peak;
+} pass_t;
+
+static pass_t Passes[PASS_COUNT] = {
+    [PASS_LEX]       = { "lex",       NULL,      true, false, PASS_LEX       },
+    [PASS_PARSE]     = { "parse",     NULL,      true, false, PASS_LEX       },
+    [PASS_NORMALIZE] = { "normalize", normalize, true, true,  PASS_PARSE     },
+    [PASS_FOLD]      = { "fold",      fold,      true, true,  PASS_NORMALIZE },
+    [PASS_CODEGEN]   = { "codegen",   NULL,      true, false, PASS_PARSE     },
+};
+
+static bool Timing = false;
+
+static bool measuring(void)
+{
+    return Timing || trace_active();
+}
+
+/* Time spent lexing on behalf of the pass currently running on this thread,
+ * which is charged to the lexer rather than to that pass */
+static THREAD_LOCAL uint64_t Lex_ns = 0;
+
+typedef struct {
+    uint64_t start;
+    uint64_t lex;
+    size_t allocs;
+    size_t tree_bytes;
+    size_t peak;
+} pass_mark_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000u) + (uint64_t)now.tv_nsec;
+}
+
+static void pass_begin(pass_mark_t* mark)
+{
+    gc_stats_t stats;
+    if (!measuring())
+        return;
+    gc_stats(&stats);
+    mark->allocs     = stats.allocated;
+    mark->tree_bytes = ast_arena_bytes();
+    mark->peak       = gc_peak_reset(0);
+    mark->lex        = Lex_ns;
+    mark->start      = now_ns();
+}
+
+static void pass_end(PassId id, pass_mark_t* mark, AST* tree)
+{
+    pass_t* pass = &Passes[id];
+    uint64_t end, elapsed;
+    uint64_t peak;
+    gc_stats_t stats;
+    if (!measuring())
+        return;
+    end = now_ns();
+    elapsed = end - mark->start - (Lex_ns - mark->lex);
+    /* The span includes any lexing, which shows up nested inside it */
+    trace_span(pass->name, mark->start, end, ast_file(tree), ast_form(tree));
+    gc_stats(&stats);
+    gc_peak_reset((mark->peak > stats.bytes_peak) ? mark->peak : stats.bytes_peak);
+    __atomic_fetch_add(&(pass->calls), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(pass->ns), elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(pass->allocs), stats.allocated - mark->allocs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(pass->tree_bytes), ast_arena_bytes() - mark->tree_bytes, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&(pass->peak), __ATOMIC_RELAXED);
+    while ((stats.bytes_peak > peak) &&
+           !__atomic_compare_exchange_n(&(pass->peak), &peak, stats.bytes_peak,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+bool pass_enable(const char* name, bool enable)
+{
+    for (int i = 0; i < PASS_COUNT; i++) {
+        if (0 != strcmp(Passes[i].name, name))
+            continue;
+        if (!enable && !Passes[i].optional) {
+            fprintf(stderr, "The '%s' pass cannot be disabled\n", name);
+            return false;
+        }
+        Passes[i].enabled = enable;
+        return true;
+    }
+    fprintf(stderr, "Unknown pass: '%s'\n", name);
+    return false;
+}
+
+void pass_timing(bool enable)
+{
+    Timing = enable;
+}
+
+void pass_lex(Parser* ctx, TokBuf* buf)
+{
+    uint64_t start, end;
+    if (!measuring()) {
+        lexer_fill(ctx, buf);
+        return;
+    }
+    /* The lexer allocates nothing so only its time is measured */
+    start = now_ns();
+    lexer_fill(ctx, buf);
+    end = now_ns();
+    trace_span(Passes[PASS_LEX].name, start, end, ctx->path, 0);
+    Lex_ns += end - start;
+    __atomic_fetch_add(&(Passes[PASS_LEX].calls), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(Passes[PASS_LEX].ns), end - start, __ATOMIC_RELAXED);
+}
+
+AST* pass_parse(Parser* ctx)
+{
+    pass_mark_t mark;
+    AST* tree;
+    /* Tokens are lexed on demand so the lexer is timed from within */
+    if (ctx->fill == lexer_fill)
+        ctx->fill = pass_lex;
+    pass_begin(&mark);
+    tree = toplevel(ctx);
+    /* Reaching the end of the input is not a form */
+    if (tree != NULL) {
+        ast_set_form(tree, ctx->path, ++ctx->forms);
+        pass_end(PASS_PARSE, &mark, tree);
+    }
+    return tree;
+}
+
+AST* pass_transform(AST* tree, PassId until)
+{
+    if (tree == NULL)
+        return NULL;
+    for (PassId i = PASS_PARSE + 1; i < until; i++) {
+        pass_mark_t mark;
+        if (!Passes[i].enabled || !Passes[Passes[i].needs].enabled ||
+            (Passes[i].run == NULL))
+            continue;
+        pass_begin(&mark);
+        tree = Passes[i].run(tree);
+        pass_end(i, &mark, tree);
+    }
+    return tree;
+}
+
+void pass_codegen(FILE* out, AST* tree)
+{
+    pass_mark_t mark;
+    pass_begin(&mark);
+    codegen(out, tree);
+    pass_end(PASS_CODEGEN, &mark, tree);
+}
+
+void pass_report(FILE* out)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < PASS_COUNT; i++)
+        total += Passes[i].ns;
+    fprintf(out, "%-10s %8s %10s %6s %10s %10s %10s\n",
+        "pass", "calls", "time ms", "%", "gc allocs", "tree KB", "peak KB");
+    for (int i = 0; i < PASS_COUNT; i++) {
+        pass_t* pass = &Passes[i];
+        if (!pass->enabled) {
+            fprintf(out, "%-10s %8s\n", pass->name, "disabled");
+            continue;
+        }
+        fprintf(out, "%-10s %8llu %10.3f %5.1f%% %10llu %10llu %10llu\n",
+            pass->name, (unsigned long long)pass->calls, pass->ns / 1e6,
+            (total > 0) ? (100.0 * pass->ns / total) : 0.0,
+            (unsigned long long)pass->allocs,
+            (unsigned long long)(pass->tree_bytes / 1024),
+            (unsigned long long)(pass->peak / 1024));
+    }
+    fprintf(out, "%-10s %8s %10.3f\n", "total", "", total / 1e6);
+}
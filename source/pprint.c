@@ -60,8 +60,8 @@ void pprint_token_type(FILE* file, Tok* token) {
 
 void pprint_token_value(FILE* file, Tok* token) {
     switch(token->type) {
-        case T_STRING: fprintf(file, "\"%s\"", token->value.text);                 break;
-        case T_ID:     fprintf(file, "%s", token->value.text);                     break;
+        case T_STRING: fprintf(file, "\"%.*s\"", (int)token->value.text.len, token->value.text.ptr); break;
+        case T_ID:     fprintf(file, "%.*s", (int)token->value.text.len, token->value.text.ptr);     break;
         case T_CHAR:   print_char(file, token->value.character);                   break;
         case T_INT:    fprintf(file, "%ld", token->value.integer);                 break;
         case T_FLOAT:  fprintf(file, "%f", token->value.floating);                 break;
@@ -102,83 +102,119 @@ static const char* tree_type_to_string(ASTType type) {
 
 static void pprint_literal(FILE* file, AST* tree, int depth)
 {
-    printf("%s:", tree_type_to_string(tree->type));
+    fprintf(file, "%s:", tree_type_to_string(tree->type));
     switch(tree->type) {
-        case AST_STRING: printf("\"%s\"", string_value(tree));  break;
-        case AST_SYMBOL: printf("%s",     symbol_value(tree));  break;
-        case AST_IDENT:  printf("%s",     ident_value(tree));   break;
-        case AST_CHAR:   printf("%c",     char_value(tree));    break;
-        case AST_INT:    printf("%ld",    integer_value(tree)); break;
-        case AST_FLOAT:  printf("%lf",    float_value(tree));   break;
-        case AST_TEMP:   printf("%ld",    temp_value(tree));    break;
+        case AST_STRING: fprintf(file, "\"%s\"", string_value(tree));  break;
+        case AST_SYMBOL: fprintf(file, "%s",     symbol_value(tree));  break;
+        case AST_IDENT:  fprintf(file, "%s",     ident_value(tree));   break;
+        case AST_CHAR:   fprintf(file, "%c",     char_value(tree));    break;
+        case AST_INT:    fprintf(file, "%ld",    integer_value(tree)); break;
+        case AST_FLOAT:  fprintf(file, "%lf",    float_value(tree));   break;
+        case AST_TEMP:   fprintf(file, "%ld",    temp_value(tree));    break;
         case AST_BOOL:
-            printf("%s", bool_value(tree) ? "true" : "false");
+            fprintf(file, "%s", bool_value(tree) ? "true" : "false");
             break;
-        default: printf("???");
+        default: fprintf(file, "???");
     }
 }
 
-void pprint_tree(FILE* file, AST* tree, int depth)
+/* Trees can be nested deeper than the C stack allows, so the parts still to
+ * be printed are kept on a stack of their own: either a subtree or a piece of
+ * punctuation that follows one */
+typedef struct {
+    AST* tree;
+    const char* text;
+} pitem_t;
+
+typedef struct {
+    pitem_t* items;
+    size_t count;
+    size_t capacity;
+} pstack_t;
+
+static void pstack_push(pstack_t* stack, AST* tree, const char* text)
 {
-    if (tree == NULL) {
-        return;
+    if (stack->count == stack->capacity) {
+        stack->capacity = (stack->capacity == 0) ? 64 : (stack->capacity * 2);
+        stack->items = realloc(stack->items, stack->capacity * sizeof(pitem_t));
+        assert(stack->items != NULL);
     }
-    print_indent(file, depth);
-    switch (tree->type) {
-        case AST_REQ:
-            printf("(require \"%s\")", require_name(tree));
-            break;
-
-        case AST_DEF:
-            printf("(def %s ", def_name(tree));
-            pprint_tree(file, def_value(tree), depth);
-            printf(")");
-            break;
-
-        case AST_IF:
-            printf("(if ");
-            pprint_tree(file, ifexpr_cond(tree), depth);
-            printf(" ");
-            pprint_tree(file, ifexpr_then(tree), depth);
-            printf(" ");
-            pprint_tree(file, ifexpr_else(tree), depth);
-            printf(")");
-            break;
-
-        case AST_FUNC:
-            printf("(fn (");
-            for (size_t i = 0; i < vec_size(func_args(tree)); i++) {
-                printf(" ");
-                pprint_literal(file, vec_at(func_args(tree), i), depth);
-            }
-            printf(")");
-            pprint_tree(file, func_body(tree), depth);
-            printf(")");
-            break;
-
-        case AST_FNAPP:
-            printf("(");
-            pprint_tree(file, fnapp_fn(tree), depth);
-            for (size_t i = 0; i < vec_size(fnapp_args(tree)); i++) {
-                printf(" ");
-                pprint_tree(file, vec_at(fnapp_args(tree), i), depth);
-            }
-            printf(")");
-            break;
-
-        case AST_LET:
-            printf("(let (");
-            pprint_tree(file, let_var(tree), depth);
-            printf(" ");
-            pprint_tree(file, let_val(tree), depth);
-            printf(") ");
-            pprint_tree(file, let_body(tree), depth);
-            printf(")");
-            break;
+    stack->items[stack->count].tree = tree;
+    stack->items[stack->count].text = text;
+    stack->count++;
+}
 
-        default:
-            pprint_literal(file, tree, depth);
-            break;
+void pprint_tree(FILE* file, AST* tree, int depth)
+{
+    pstack_t stack = { NULL, 0, 0 };
+    pstack_push(&stack, tree, NULL);
+    while (stack.count > 0) {
+        pitem_t item = stack.items[--stack.count];
+        tree = item.tree;
+        if (item.text != NULL) {
+            fputs(item.text, file);
+            continue;
+        } else if (tree == NULL) {
+            continue;
+        }
+        /* Children are pushed in reverse so they come off in order */
+        print_indent(file, depth);
+        switch (tree->type) {
+            case AST_REQ:
+                fprintf(file, "(require \"%s\")", require_name(tree));
+                break;
+
+            case AST_DEF:
+                fprintf(file, "(def %s ", def_name(tree));
+                pstack_push(&stack, NULL, ")");
+                pstack_push(&stack, def_value(tree), NULL);
+                break;
+
+            case AST_IF:
+                fprintf(file, "(if ");
+                pstack_push(&stack, NULL, ")");
+                pstack_push(&stack, ifexpr_else(tree), NULL);
+                pstack_push(&stack, NULL, " ");
+                pstack_push(&stack, ifexpr_then(tree), NULL);
+                pstack_push(&stack, NULL, " ");
+                pstack_push(&stack, ifexpr_cond(tree), NULL);
+                break;
+
+            case AST_FUNC:
+                fprintf(file, "(fn (");
+                for (size_t i = 0; i < func_nargs(tree); i++) {
+                    fprintf(file, " ");
+                    pprint_literal(file, func_arg(tree, i), depth);
+                }
+                fprintf(file, ")");
+                pstack_push(&stack, NULL, ")");
+                pstack_push(&stack, func_body(tree), NULL);
+                break;
+
+            case AST_FNAPP:
+                fprintf(file, "(");
+                pstack_push(&stack, NULL, ")");
+                for (size_t i = fnapp_nargs(tree); i > 0; i--) {
+                    pstack_push(&stack, fnapp_arg(tree, i-1), NULL);
+                    pstack_push(&stack, NULL, " ");
+                }
+                pstack_push(&stack, fnapp_fn(tree), NULL);
+                break;
+
+            case AST_LET:
+                fprintf(file, "(let (");
+                pstack_push(&stack, NULL, ")");
+                pstack_push(&stack, let_body(tree), NULL);
+                pstack_push(&stack, NULL, ") ");
+                pstack_push(&stack, let_val(tree), NULL);
+                pstack_push(&stack, NULL, " ");
+                pstack_push(&stack, let_var(tree), NULL);
+                break;
+
+            default:
+                pprint_literal(file, tree, depth);
+                break;
+        }
     }
+    free(stack.items);
 }
-
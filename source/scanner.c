@@ -0,0 +1,351 @@
+/**
+  @file scanner.c
+  @brief Hand-written drop-in replacement for the flex lexer.
+
+  Produces the same tokens as lexer.l. The input is split into runs of
+  whitespace and runs of non-delimiter characters, and the length of each run
+  is found 16 or 32 bytes at a time when the compiler targets SSE2 or AVX2.
+  Each run is then classified the way flex's longest match would classify it.
+  Build it with `make sclpl-simd`.
+  */
+#include <sclpl.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    const char* pos;
+    const char* end;
+} scanner_t;
+
+/* Character Classes
+ *****************************************************************************/
+/* Characters that end an identifier in the last rule of lexer.l */
+#define DELIMS " \t\r\n[]{}()'\",;:"
+
+enum { C_SPACE = 1, C_DELIM = 2 };
+
+static const uint8_t Class[256] = {
+    [' ']  = C_SPACE|C_DELIM, ['\t'] = C_SPACE|C_DELIM,
+    ['\r'] = C_SPACE|C_DELIM, ['\n'] = C_SPACE|C_DELIM,
+    ['[']  = C_DELIM, [']'] = C_DELIM, ['{'] = C_DELIM, ['}'] = C_DELIM,
+    ['(']  = C_DELIM, [')'] = C_DELIM, ['\''] = C_DELIM, ['"'] = C_DELIM,
+    [',']  = C_DELIM, [';'] = C_DELIM, [':'] = C_DELIM,
+};
+
+#define CLASS(c) (Class[(uint8_t)(c)])
+
+#if defined(__AVX2__)
+    #define VEC_BYTES 32
+    typedef __m256i vbyte_t;
+    #define vload(p)  _mm256_loadu_si256((const __m256i*)(p))
+    #define vsplat(c) _mm256_set1_epi8(c)
+    #define veq(a,b)  _mm256_cmpeq_epi8(a,b)
+    #define vor(a,b)  _mm256_or_si256(a,b)
+    #define vmask(a)  ((uint32_t)_mm256_movemask_epi8(a))
+    #define VEC_ALL   0xFFFFFFFFu
+#elif defined(__SSE2__)
+    #define VEC_BYTES 16
+    typedef __m128i vbyte_t;
+    #define vload(p)  _mm_loadu_si128((const __m128i*)(p))
+    #define vsplat(c) _mm_set1_epi8(c)
+    #define veq(a,b)  _mm_cmpeq_epi8(a,b)
+    #define vor(a,b)  _mm_or_si128(a,b)
+    #define vmask(a)  ((uint32_t)_mm_movemask_epi8(a))
+    #define VEC_ALL   0xFFFFu
+#endif
+
+#ifdef VEC_BYTES
+/* Returns a bit for each byte of the block that is one of the given chars */
+static inline uint32_t match_any(vbyte_t block, const char* chars, size_t count)
+{
+    vbyte_t hits = veq(block, vsplat(chars[0]));
+    for (size_t i = 1; i < count; i++)
+        hits = vor(hits, veq(block, vsplat(chars[i])));
+    return vmask(hits);
+}
+#endif
+
+/* Vector loads never run past the end of the input, the scalar loops pick up
+ * whatever is left over */
+static const char* skip_space(const char* s, const char* end)
+{
+#ifdef VEC_BYTES
+    for (; s + VEC_BYTES <= end; s += VEC_BYTES) {
+        uint32_t other = match_any(vload(s), " \t\r\n", 4) ^ VEC_ALL;
+        if (other)
+            return s + __builtin_ctz(other);
+    }
+#endif
+    while ((s < end) && (CLASS(*s) & C_SPACE))
+        s++;
+    return s;
+}
+
+static const char* find_delim(const char* s, const char* end)
+{
+#ifdef VEC_BYTES
+    for (; s + VEC_BYTES <= end; s += VEC_BYTES) {
+        uint32_t delims = match_any(vload(s), DELIMS, sizeof(DELIMS)-1);
+        if (delims)
+            return s + __builtin_ctz(delims);
+    }
+#endif
+    while ((s < end) && !(CLASS(*s) & C_DELIM))
+        s++;
+    return s;
+}
+
+static const char* find_quote(const char* s, const char* end)
+{
+#ifdef VEC_BYTES
+    for (; s + VEC_BYTES <= end; s += VEC_BYTES) {
+        uint32_t quotes = match_any(vload(s), "\"", 1);
+        if (quotes)
+            return s + __builtin_ctz(quotes);
+    }
+#endif
+    while ((s < end) && (*s != '"'))
+        s++;
+    return s;
+}
+
+/* Token Classification
+ *****************************************************************************/
+static bool is_digit(char c)
+{
+    return ((c >= '0') && (c <= '9'));
+}
+
+static bool all_in(const char* s, const char* end, const char* set)
+{
+    for (; s < end; s++)
+        if ((*s == '\0') || (strchr(set, *s) == NULL))
+            return false;
+    return true;
+}
+
+static bool word_is(const char* s, size_t len, const char* word)
+{
+    return ((strlen(word) == len) && (0 == memcmp(s, word, len)));
+}
+
+static TokType number(Tok* tok, const char* s, const char* end)
+{
+    const char *p, *q;
+    /* Radix forms, anything else with a radix-like prefix is an identifier */
+    if ((s[0] == '0') && (end - s > 2)) {
+        int base = 0;
+        const char* digits = NULL;
+        switch (s[1]) {
+            case 'b': base = 2;  digits = "01";                     break;
+            case 'o': base = 8;  digits = "01234567";               break;
+            case 'd': base = 10; digits = "0123456789";             break;
+            case 'h': base = 16; digits = "0123456789abcdefABCDEF"; break;
+        }
+        if ((base != 0) && all_in(s+2, end, digits)) {
+            tok->value.integer = strtol(&s[2], NULL, base);
+            return T_INT;
+        }
+        if ((s[1] == 'b' || s[1] == '0' || s[1] == 'd' || s[1] == 'h') &&
+            all_in(s+2, end, "0123456789abcdefABCDEF"))
+            return T_ID;
+    }
+    /* Decimal integers and floats */
+    p = s + ((s[0] == '+') || (s[0] == '-'));
+    for (q = p; (q < end) && is_digit(*q); q++);
+    if (q == p)
+        return T_ID;
+    if (q == end) {
+        tok->value.integer = strtol(s, NULL, 10);
+        return T_INT;
+    }
+    if (*q++ != '.')
+        return T_ID;
+    for (p = q; (q < end) && is_digit(*q); q++);
+    if (q == p)
+        return T_ID;
+    if ((q < end) && (*q == 'e')) {
+        q++;
+        if ((q < end) && ((*q == '+') || (*q == '-')))
+            q++;
+        for (p = q; (q < end) && is_digit(*q); q++);
+        if (q == p)
+            return T_ID;
+    }
+    if (q != end)
+        return T_ID;
+    tok->value.floating = strtod(s, NULL);
+    return T_FLOAT;
+}
+
+static TokType character(Tok* tok, const char* s, const char* end)
+{
+    size_t len = end - s;
+    if (len == 2) {
+        tok->value.character = s[1];
+        return T_CHAR;
+    }
+    if      (word_is(s, len, "\\space"))   tok->value.character = ' ';
+    else if (word_is(s, len, "\\newline")) tok->value.character = '\n';
+    else if (word_is(s, len, "\\return"))  tok->value.character = '\r';
+    else if (word_is(s, len, "\\tab"))     tok->value.character = '\t';
+    else if (word_is(s, len, "\\vtab"))    tok->value.character = '\v';
+    else return T_ID;
+    return T_CHAR;
+}
+
+static TokType keyword(Tok* tok, const char* s, size_t len)
+{
+    static const struct { const char* word; TokType type; } keywords[] = {
+        { "end",  T_END }, { "require", T_REQUIRE }, { "def",  T_DEF  },
+        { "if",   T_IF  }, { "fn",      T_FN      }, { "then", T_THEN },
+        { "else", T_ELSE },
+    };
+    if ((len == 1) && (s[0] == '&'))
+        return T_AMP;
+    if (word_is(s, len, "true") || word_is(s, len, "false")) {
+        tok->value.boolean = (s[0] == 't');
+        return T_BOOL;
+    }
+    for (size_t i = 0; i < sizeof(keywords)/sizeof(keywords[0]); i++)
+        if (word_is(s, len, keywords[i].word))
+            return keywords[i].type;
+    return T_ID;
+}
+
+/* Scanning
+ *****************************************************************************/
+static TokType scan_string(scanner_t* sc, Tok* tok, const char* s)
+{
+    /* Like flex, take the longest match: escaped quotes may either end the
+     * string or be part of it, the first unescaped one has to end it */
+    const char* close = NULL;
+    const char* q = s + 1;
+    while ((q = find_quote(q, sc->end)) < sc->end) {
+        close = q;
+        if (q[-1] != '\\')
+            break;
+        q++;
+    }
+    if (close == NULL) {
+        /* Nothing matches so flex would echo the quote and move on */
+        fputc('"', stdout);
+        sc->pos = s + 1;
+        return T_END_FILE;
+    }
+    tok->value.text.ptr = s + 1;
+    tok->value.text.len = close - s - 1;
+    sc->pos = close + 1;
+    return T_STRING;
+}
+
+static TokType scan(scanner_t* sc, Tok* tok, const char** start)
+{
+    for (;;) {
+        const char* s = skip_space(sc->pos, sc->end);
+        const char* end;
+        TokType type;
+        *start = s;
+        if (s >= sc->end) {
+            sc->pos = s;
+            return T_END_FILE;
+        }
+        sc->pos = s + 1;
+        switch (*s) {
+            case '(':  return T_LPAR;
+            case ')':  return T_RPAR;
+            case '[':  return T_LBRACK;
+            case ']':  return T_RBRACK;
+            case '{':  return T_LBRACE;
+            case '}':  return T_RBRACE;
+            case ';':  return T_END;
+            case ',':  return T_COMMA;
+            case '\'': return T_SQUOTE;
+            case ':':  return T_COLON;
+            case '"':
+                type = scan_string(sc, tok, s);
+                if (type == T_END_FILE)
+                    continue;
+                return type;
+        }
+        /* Everything else is a run of non-delimiters that is a single token
+         * unless a backslash is followed by a delimiter */
+        end = find_delim(s + 1, sc->end);
+        if ((*s == '\\') && (end == s + 1)) {
+            if ((end < sc->end) && (*end != '\n')) {
+                tok->value.character = s[1];
+                sc->pos = s + 2;
+                return T_CHAR;
+            }
+        }
+        sc->pos = end;
+        if (*s == '\\' && end - s > 1)
+            type = character(tok, s, end);
+        else if (is_digit(*s) || *s == '+' || *s == '-')
+            type = number(tok, s, end);
+        else
+            type = keyword(tok, s, end - s);
+        if (type == T_ID) {
+            tok->value.text.ptr = s;
+            tok->value.text.len = end - s;
+        }
+        return type;
+    }
+}
+
+/* Lexer Interface
+ *****************************************************************************/
+void lexer_init(Parser* ctx)
+{
+    scanner_t* sc = (scanner_t*)malloc(sizeof(scanner_t));
+    assert(sc != NULL);
+    sc->pos = ctx->data;
+    sc->end = ctx->data + ctx->size;
+    ctx->scanner = sc;
+}
+
+void lexer_deinit(Parser* ctx)
+{
+    free(ctx->scanner);
+    ctx->scanner = NULL;
+}
+
+Tok* gettoken(Parser* ctx)
+{
+    Tok value, *tok = NULL;
+    const char* start;
+    int type = scan(ctx->scanner, &value, &start);
+    if (type != T_END_FILE) {
+        tok = (Tok*)gc_alloc(sizeof(Tok), NULL);
+        memset(tok, 0, sizeof(Tok));
+        tok->type = type;
+        memcpy(&(tok->value), &(value.value), sizeof(value.value));
+        parser_locate(ctx, (uint32_t)(start - ctx->data), tok);
+    }
+    return tok;
+}
+
+void lexer_fill(Parser* ctx, TokBuf* buf)
+{
+    Tok value;
+    const char* start;
+    /* Lex a whole chunk in one go, stopping early at the end of the file */
+    buf->index = 0;
+    buf->count = 0;
+    while (buf->count < TOK_CHUNK) {
+        int type = scan(ctx->scanner, &value, &start);
+        buf->types[buf->count]   = type;
+        buf->offsets[buf->count] = (uint32_t)(start - ctx->data);
+        buf->values[buf->count]  = value.value;
+        buf->count++;
+        if (type == T_END_FILE)
+            break;
+    }
+}
+
+void fetchline(Parser* ctx)
+{
+    /* Tokens are read a chunk at a time so there is no line to skip to */
+    (void)ctx;
+}
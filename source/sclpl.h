@@ -13,30 +13,84 @@
 #include <errno.h>
 #include <assert.h>
 #include <setjmp.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
 #include <opt.h>
 
+/* Each compiler thread gets its own copy of anything declared with this */
+#define THREAD_LOCAL __thread
+
 /* Garbage Collection
  *****************************************************************************/
 typedef void (*destructor_t)(void*);
+/* Tracers call visit on every counted reference held by an object */
+typedef void (*tracer_t)(void* obj, void (*visit)(void*));
+/* Told when each collection started and how long it paused, in us */
+typedef void (*collect_hook_t)(uint64_t start, uint64_t pause);
+
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct {
+    size_t collections;
+    size_t allocated;
+    size_t freed;
+    size_t cycle_collections;
+    size_t cycle_freed;
+    size_t sweep_steps;
+    size_t region_allocated;
+    size_t bytes_live;
+    size_t bytes_peak; /* largest of any one thread in gc_stats_total */
+    size_t zct_size;
+    size_t mrt_size;
+    uint64_t pause_total_us;
+    uint64_t pause_max_us;
+    /* pauses[0] counts pauses under 1us, pauses[i] those under 2^i us */
+    size_t pauses[GC_PAUSE_BUCKETS];
+} gc_stats_t;
 
 void gc_init(void** stack_bottom);
+void gc_thread_init(void** stack_bottom);
 void gc_deinit(void);
+void gc_fast_exit(bool enable);
 void gc_collect(void);
 void* gc_alloc(size_t size, destructor_t destructor);
 void* gc_addref(void* ptr);
 void gc_delref(void* ptr);
 void gc_swapref(void** dest, void* newref);
+void gc_region_begin(void);
+void* gc_region_alloc(size_t size, destructor_t destructor);
+void gc_region_reset(void);
+void gc_region_end(void);
+void gc_set_tracer(destructor_t destructor, tracer_t tracer);
+void gc_set_collect_hook(collect_hook_t hook);
+void gc_root(void** slot);
+void gc_unroot(void** slot);
+void gc_safepoint(void);
+void gc_stats(gc_stats_t* stats);
+size_t gc_peak_reset(size_t peak);
+void gc_stats_total(gc_stats_t* stats);
 
 // Redefine main
 extern int user_main(int argc, char** argv);
 
 /* Vector Implementation
  *****************************************************************************/
+/* Most vectors hold a handful of arguments so keep that many inline */
+#define VEC_INLINE 4
+
 typedef struct {
     size_t count;
-    size_t size;
     size_t capacity;
-    void** buffer;
+    union {
+        void* items[VEC_INLINE];
+        void** buffer;
+    } data;
 } vec_t;
 
 void vec_init(vec_t* vec);
@@ -44,7 +98,9 @@ void vec_deinit(vec_t* vec);
 void vec_clear(vec_t* vec);
 size_t vec_size(vec_t* vec);
 void* vec_at(vec_t* vec, size_t index);
+void vec_reserve(vec_t* vec, size_t size);
 void vec_push_back(vec_t* vec, void* data);
+void vec_push_move(vec_t* vec, void* data);
 void vec_set(vec_t* vec, size_t index, void* data);
 
 /* Token Types
@@ -55,20 +111,39 @@ typedef enum {
     T_REQUIRE, T_DEF, T_IF, T_FN, T_THEN, T_ELSE, T_END_FILE
 } TokType;
 
+typedef union {
+    /* Identifier and string tokens point into the parser's input */
+    struct {
+        const char* ptr;
+        size_t len;
+    } text;
+    uint32_t character;
+    intptr_t integer;
+    double floating;
+    bool boolean;
+} TokValue;
+
 typedef struct {
     const char* file;
     size_t line;
     size_t col;
     TokType type;
-    union {
-        char* text;
-        uint32_t character;
-        intptr_t integer;
-        double floating;
-        bool boolean;
-    } value;
+    TokValue value;
 } Tok;
 
+/* The parser reads tokens a chunk at a time from a flat buffer kept in
+ * structure of arrays form, so it never allocates a token of its own */
+#define TOK_CHUNK 256
+
+typedef struct {
+    size_t index;
+    size_t count;
+    uint8_t types[TOK_CHUNK];
+    /* Byte offsets into the input, see parser_locate() */
+    uint32_t offsets[TOK_CHUNK];
+    TokValue values[TOK_CHUNK];
+} TokBuf;
+
 /* AST Types
  *****************************************************************************/
 typedef enum ASTType {
@@ -76,36 +151,34 @@ typedef enum ASTType {
     AST_REQ, AST_DEF, AST_IF, AST_FUNC, AST_FNAPP, AST_LET, AST_TEMP
 } ASTType;
 
+/* Nodes are packed into an arena per top-level form and refer to their
+ * children by 32-bit index, 0 being no node at all. Argument lists are runs of
+ * indices in a side table of the arena, which a list only joins once its
+ * *_end_args has been called. After ast_use_heap(true) they are objects on
+ * the collected heap instead. Use the accessors below rather than the
+ * fields. */
 typedef struct AST {
     ASTType type;
+    /* Definition value, If condition, Function body, Application function
+     * or Let variable */
+    uint32_t child;
     union {
         /* Definition Node */
-        struct {
-            char* name;
-            struct AST* type;
-            struct AST* value;
-        } def;
+        char* name;
         /* If Expression */
         struct {
-            struct AST* cond;
-            struct AST* bthen;
-            struct AST* belse;
+            uint32_t bthen;
+            uint32_t belse;
         } ifexpr;
-        /* Function */
-        struct {
-            vec_t args;
-            struct AST* body;
-        } func;
-        /* Function Application */
+        /* Function and Function Application */
         struct {
-            struct AST* fn;
-            vec_t args;
-        } fnapp;
+            uint32_t first;
+            uint32_t count;
+        } args;
         /* Let Expression */
         struct {
-            struct AST* temp;
-            struct AST* value;
-            struct AST* body;
+            uint32_t value;
+            uint32_t body;
         } let;
         /* String, Symbol, Identifier */
         char* text;
@@ -120,6 +193,18 @@ typedef struct AST {
     } value;
 } AST;
 
+/* Arenas */
+void ast_use_heap(bool enable);
+void ast_arena_begin(void);
+void ast_arena_use(AST* tree);
+void ast_arena_free(AST* tree);
+size_t ast_arena_bytes(void);
+AST* ast_hold(AST* tree);
+void ast_release(AST* tree);
+void ast_set_form(AST* tree, const char* file, size_t form);
+const char* ast_file(AST* tree);
+size_t ast_form(AST* tree);
+
 /* String */
 AST* String(Tok* val);
 char* string_value(AST* val);
@@ -160,6 +245,7 @@ char* require_name(AST* req);
 AST* Def(Tok* name, AST* value);
 char* def_name(AST* def);
 AST* def_value(AST* def);
+void def_set_value(AST* def, AST* value);
 
 /* If Expression */
 AST* IfExpr(void);
@@ -172,38 +258,42 @@ void ifexpr_set_else(AST* ifexpr, AST* belse);
 
 /* Function */
 AST* Func(void);
-vec_t* func_args(AST* func);
+size_t func_nargs(AST* func);
+AST* func_arg(AST* func, size_t index);
 AST* func_body(AST* func);
 void func_add_arg(AST* func, AST* arg);
+void func_end_args(AST* func);
 void func_set_body(AST* func, AST* body);
 
 /* Function Application */
 AST* FnApp(AST* fn);
 AST* fnapp_fn(AST* fnapp);
 void fnapp_set_fn(AST* fnapp, AST* fn);
-vec_t* fnapp_args(AST* fnapp);
+size_t fnapp_nargs(AST* fnapp);
+AST* fnapp_arg(AST* fnapp, size_t index);
+void fnapp_set_arg(AST* fnapp, size_t index, AST* arg);
 void fnapp_add_arg(AST* func, AST* arg);
+void fnapp_end_args(AST* fnapp);
 
 /* Let Expression */
 AST* Let(AST* temp, AST* val, AST* body);
 AST* let_var(AST* let);
 AST* let_val(AST* let);
+void let_set_val(AST* let, AST* value);
 AST* let_body(AST* let);
 void let_set_body(AST* let, AST* body);
 
 /* Symbol Table
  *****************************************************************************/
+/* Names are interned so that two symbols with the same name are the same
+ * entry and identifiers can be compared by pointer */
 typedef struct SymTable {
     struct SymTable* next;
     char* name;
 } SymTable;
 
-SymTable* symbol_new(void);
-//void symbol_free(SymTable* sym);
-SymTable* symbol_push(SymTable* top, SymTable* newtop);
-SymTable* symbol_pop(SymTable* top);
+SymTable* symbol_intern(const char* name, size_t len);
 SymTable* symbol_get(const char* name);
-SymTable* symbol_map(SymTable* top, void (*apply)(SymTable*, void*), void* arg);
 
 /*
 Base Types:
@@ -262,27 +352,79 @@ void pprint_tree(FILE* file, AST* tree, int depth);
 
 /* Lexer and Parser Types
  *****************************************************************************/
-typedef struct {
+typedef struct Parser {
     char* line;
     size_t index;
     size_t lineno;
     FILE* input;
     char* prompt;
-    Tok* tok;
+    Tok tok;
+    TokBuf tokens;
+    char* data;
+    size_t size;
+    bool mapped;
+    void* scanner;
+    FILE* errors;
+    jmp_buf* onerror;
+    void* frames;
+    size_t nframes;
+    size_t maxframes;
+    /* Deepest nesting accepted, 0 for no limit */
+    size_t maxdepth;
+    const char* path;
+    uint32_t* lines;
+    size_t nlines;
+    size_t lastline;
+    /* Refills the token buffer, lexer_fill unless tokens come from elsewhere */
+    void (*fill)(struct Parser* ctx, TokBuf* buf);
+    /* Top-level forms read so far */
+    size_t forms;
 } Parser;
 
 // Lexer routines
+void lexer_init(Parser* ctx);
+void lexer_deinit(Parser* ctx);
 Tok* gettoken(Parser* ctx);
+void lexer_fill(Parser* ctx, TokBuf* buf);
 void fetchline(Parser* ctx);
 
 // Parser routines
 Parser* parser_new(char* p_prompt, FILE* input);
+Parser* parser_open(const char* path);
+void parser_locate(Parser* p, uint32_t offset, Tok* tok);
 
 // Grammar Routines
 AST* toplevel(Parser* p);
 
 // Compiler Passes
 AST* normalize(AST* tree);
+AST* fold(AST* tree);
 void codegen(FILE* file, AST* tree);
 
+/* Pass Manager
+ *****************************************************************************/
+/* Passes in the order each top-level form goes through them */
+typedef enum {
+    PASS_LEX, PASS_PARSE, PASS_NORMALIZE, PASS_FOLD, PASS_CODEGEN, PASS_COUNT
+} PassId;
+
+/* The parser nests to any depth but the passes after it recurse, so forms
+ * they see are limited to a depth that fits well within an 8MB stack */
+#define PASS_MAX_DEPTH 10000
+
+bool pass_enable(const char* name, bool enable);
+void pass_timing(bool enable);
+void pass_lex(Parser* ctx, TokBuf* buf);
+AST* pass_parse(Parser* ctx);
+AST* pass_transform(AST* tree, PassId until);
+void pass_codegen(FILE* out, AST* tree);
+void pass_report(FILE* out);
+
+/* Trace Export
+ *****************************************************************************/
+bool trace_open(const char* path);
+bool trace_active(void);
+void trace_span(const char* name, uint64_t start, uint64_t end, const char* file, size_t form);
+void trace_close(void);
+
 #endif /* SCLPL_H */
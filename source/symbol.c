@@ -0,0 +1,71 @@
+/**
+  @file symbol.c
+  @brief See header for details
+  */
+#include <sclpl.h>
+
+/* Intern Pool
+ *
+ * Every distinct name is stored exactly once so names can be compared by
+ * pointer. Entries and buckets are collected objects that the pool keeps a
+ * reference to for the life of the thread, each thread has a pool of its own
+ * as it does a heap.
+ *****************************************************************************/
+static THREAD_LOCAL SymTable** Buckets = NULL;
+static THREAD_LOCAL size_t Num_Buckets = 0;
+static THREAD_LOCAL size_t Num_Symbols = 0;
+
+static uint32_t symbol_hash(const char* name, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash;
+}
+
+static void symbol_grow(void)
+{
+    size_t count = (Num_Buckets == 0) ? 256 : (Num_Buckets * 2);
+    SymTable** buckets = (SymTable**)gc_addref(gc_alloc(count * sizeof(SymTable*), NULL));
+    memset(buckets, 0, count * sizeof(SymTable*));
+    for (size_t i = 0; i < Num_Buckets; i++) {
+        SymTable* sym = Buckets[i];
+        while (sym != NULL) {
+            SymTable* next = sym->next;
+            size_t index = symbol_hash(sym->name, strlen(sym->name)) & (count - 1);
+            sym->next = buckets[index];
+            buckets[index] = sym;
+            sym = next;
+        }
+    }
+    gc_delref(Buckets);
+    Buckets = buckets;
+    Num_Buckets = count;
+}
+
+SymTable* symbol_intern(const char* name, size_t len)
+{
+    SymTable* sym;
+    uint32_t hash = symbol_hash(name, len);
+    if (Num_Symbols >= Num_Buckets)
+        symbol_grow();
+    for (sym = Buckets[hash & (Num_Buckets - 1)]; sym != NULL; sym = sym->next) {
+        if ((0 == strncmp(sym->name, name, len)) && (sym->name[len] == '\0'))
+            return sym;
+    }
+    /* The name is kept in the same object, right after the entry */
+    sym = (SymTable*)gc_addref(gc_alloc(sizeof(SymTable) + len + 1, NULL));
+    sym->name = (char*)(sym + 1);
+    memcpy(sym->name, name, len);
+    sym->name[len] = '\0';
+    sym->next = Buckets[hash & (Num_Buckets - 1)];
+    Buckets[hash & (Num_Buckets - 1)] = sym;
+    Num_Symbols++;
+    return sym;
+}
+
+SymTable* symbol_get(const char* name)
+{
+    return symbol_intern(name, strlen(name));
+}
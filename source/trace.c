@@ -0,0 +1,104 @@
+#include <sclpl.h>
+
+/* Trace Export
+ *
+ * Writes a timeline of the run in the trace event format that
+ * chrome://tracing and Perfetto read. The passes report a span for every form
+ * they handle, tagged with the input it came from, and each collection is
+ * marked with an instant event carrying its pause. Every event is written with a single call to fprintf, which
+ * stdio keeps whole when several threads write at once. Timestamps are in
+ * microseconds since the trace was opened.
+ *****************************************************************************/
+static FILE* Trace = NULL;
+static uint64_t Trace_Start = 0;
+static int Num_Threads = 0;
+static THREAD_LOCAL int Thread_Id = 0;
+
+static uint64_t trace_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000u) + (uint64_t)now.tv_nsec;
+}
+
+static double trace_us(uint64_t ns)
+{
+    return (ns > Trace_Start) ? ((ns - Trace_Start) / 1e3) : 0.0;
+}
+
+static int trace_thread(void)
+{
+    /* Threads are numbered in the order they first report something */
+    if (Thread_Id == 0)
+        Thread_Id = __atomic_add_fetch(&Num_Threads, 1, __ATOMIC_RELAXED);
+    return Thread_Id;
+}
+
+static void trace_collect(uint64_t start, uint64_t pause)
+{
+    fprintf(Trace, "{\"name\":\"gc_collect\",\"cat\":\"gc\",\"ph\":\"i\",\"s\":\"t\","
+        "\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"pause_us\":%llu}},\n",
+        trace_us(start * 1000u), trace_thread(), (unsigned long long)pause);
+}
+
+bool trace_open(const char* path)
+{
+    Trace = fopen(path, "w");
+    if (Trace == NULL)
+        return false;
+    Trace_Start = trace_now_ns();
+    fputs("{\"traceEvents\":[\n", Trace);
+    gc_set_collect_hook(trace_collect);
+    return true;
+}
+
+bool trace_active(void)
+{
+    return (Trace != NULL);
+}
+
+static void trace_string(char* out, size_t size, const char* str)
+{
+    /* Escapes a string for JSON, cutting it short if the buffer fills up */
+    size_t len = 0;
+    for (; (*str != '\0') && (len + 7 < size); str++) {
+        unsigned char ch = (unsigned char)*str;
+        if ((ch == '"') || (ch == '\\'))
+            len += sprintf(out + len, "\\%c", ch);
+        else if (ch < 0x20)
+            len += sprintf(out + len, "\\u%04x", ch);
+        else
+            out[len++] = ch;
+    }
+    out[len] = '\0';
+}
+
+void trace_span(const char* name, uint64_t start, uint64_t end, const char* file, size_t form)
+{
+    char path[1024];
+    if (Trace == NULL)
+        return;
+    /* Several files may be compiled at once, each with forms numbered from 1 */
+    trace_string(path, sizeof(path), (file != NULL) ? file : "<stdin>");
+    if (form > 0) {
+        fprintf(Trace, "{\"name\":\"%s\",\"cat\":\"pass\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"file\":\"%s\",\"form\":%zu}},\n",
+            name, trace_us(start), (end - start) / 1e3, trace_thread(), path, form);
+    } else {
+        fprintf(Trace, "{\"name\":\"%s\",\"cat\":\"pass\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"file\":\"%s\"}},\n",
+            name, trace_us(start), (end - start) / 1e3, trace_thread(), path);
+    }
+}
+
+void trace_close(void)
+{
+    if (Trace == NULL)
+        return;
+    gc_set_collect_hook(NULL);
+    /* The last event has no comma after it so it closes the list */
+    fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+          "\"args\":{\"name\":\"sclpl\"}}\n]}\n", Trace);
+    fclose(Trace);
+    Trace = NULL;
+}
@@ -3,21 +3,23 @@
 */
 #include <sclpl.h>
 
-#ifndef DEFAULT_VEC_CAPACITY
-#define DEFAULT_VEC_CAPACITY (size_t)8
-#endif
+static void** vec_data(vec_t* vec)
+{
+    return (vec->capacity > VEC_INLINE) ? vec->data.buffer : vec->data.items;
+}
 
 void vec_init(vec_t* vec)
 {
     vec->count    = 0;
-    vec->capacity = DEFAULT_VEC_CAPACITY;
-    vec->buffer   = malloc(sizeof(void*) * vec->capacity);
+    vec->capacity = VEC_INLINE;
 }
 
 void vec_deinit(vec_t* vec)
 {
     vec_clear(vec);
-    free(vec->buffer);
+    if (vec->capacity > VEC_INLINE)
+        free(vec->data.buffer);
+    vec->capacity = VEC_INLINE;
 }
 
 size_t vec_size(vec_t* vec)
@@ -28,58 +30,52 @@ size_t vec_size(vec_t* vec)
 void* vec_at(vec_t* vec, size_t index)
 {
     assert(index < vec->count);
-    return vec->buffer[index];
+    return vec_data(vec)[index];
 }
 
-static void vec_reserve(vec_t* vec, size_t size)
+void vec_reserve(vec_t* vec, size_t size)
 {
+    void** buffer;
     assert(vec != NULL);
-    vec->buffer = realloc( vec->buffer, sizeof(void*) * size );
-    assert(vec->buffer != NULL);
-    vec->capacity = size;
-}
-
-static size_t vec_next_capacity(size_t req_size)
-{
-    size_t next_power = req_size;
-    size_t num_bits = sizeof(size_t) * 8;
-    size_t bit_n;
-    /* Find the next highest power of 2 */
-    next_power--;
-    for (bit_n = 1; bit_n < num_bits; bit_n = bit_n << 1)
-    {
-        next_power = next_power | (next_power >> bit_n);
+    if (size <= vec->capacity)
+        return;
+    /* Grow geometrically so a run of pushes only reallocates log(n) times */
+    if (size < (2 * vec->capacity))
+        size = 2 * vec->capacity;
+    if (vec->capacity > VEC_INLINE) {
+        buffer = realloc(vec->data.buffer, sizeof(void*) * size);
+    } else {
+        buffer = malloc(sizeof(void*) * size);
+        if (buffer != NULL)
+            memcpy(buffer, vec->data.items, sizeof(void*) * vec->count);
     }
-    next_power++;
-    return next_power;
+    assert(buffer != NULL);
+    vec->data.buffer = buffer;
+    vec->capacity = size;
 }
 
-static void vec_resize(vec_t* vec, size_t count, void* fillval)
+void vec_push_back(vec_t* vec, void* data)
 {
-    if (count > vec->count) {
-        vec_reserve(vec, vec_next_capacity(count+1));
-        for (; vec->count < count; vec->count++)
-            vec->buffer[vec->count] = gc_addref(fillval);
-    } else if (count < vec->count) {
-        vec->count = count;
-    }
+    vec_push_move(vec, gc_addref(data));
 }
 
-void vec_push_back(vec_t* vec, void* data)
+void vec_push_move(vec_t* vec, void* data)
 {
-    vec_resize(vec, vec->count+1, data);
+    /* The vector takes over a reference the caller already holds */
+    vec_reserve(vec, vec->count+1);
+    vec_data(vec)[vec->count++] = data;
 }
 
 void vec_set(vec_t* vec, size_t index, void* data)
 {
     assert(index < vec->count);
-    gc_swapref((void**)&(vec->buffer[index]), data);
+    gc_swapref(&(vec_data(vec)[index]), data);
 }
 
 void vec_clear(vec_t* vec)
 {
+    void** items = vec_data(vec);
     for (size_t i = 0; i < vec->count; i++)
-        gc_delref(vec->buffer[i]);
+        gc_delref(items[i]);
     vec->count = 0;
 }
-
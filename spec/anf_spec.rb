@@ -183,6 +183,23 @@ describe "sclpl a-normal form" do
       ])
     end
 
+    it "should keep every binding of a statement followed by others" do
+      expect(anf('fn() foo(bar(),baz()) 1;')).to eq([
+        ["fn", [],
+          ["let", ["$:2", ["T_ID:bar"]],
+            ["let", ["$:3", ["T_ID:baz"]],
+              ["let", ["$:0", ["T_ID:foo", "$:2", "$:3"]],
+                ["let", ["$:1", "T_INT:1"],
+                  "$:1"]]]]]
+      ])
+    end
+
+    it "should normalize a block longer than the C stack is deep" do
+      count = 200000
+      out = cli(['-Aanf'], "fn() " + ("foo(bar()) " * count) + ";")
+      expect(out.scan("(T_ID:foo $:").length).to eq(count)
+    end
+
     #it "should normalize a literal with an if expression" do
     #  expect(anf('fn() if 1 2 else 3;;')).to eq([
     #    ["fn", [],
@@ -197,4 +214,36 @@ describe "sclpl a-normal form" do
     #  ])
     #end
   end
+
+  context "nesting depth" do
+    # Each argument list, parenthesis, if, function and block is a level
+    def nested(shape, depth)
+      case shape
+      when :calls then ('f(' * depth) + '1' + (')' * depth)
+      when :ifs   then ('if a then ' * depth) + 'b' + (' end' * depth)
+      when :fns   then ('fn(a) ' * depth) + 'a' + (' end' * depth)
+      end
+    end
+
+    it "should compile expressions nested as deep as the passes allow" do
+      { :calls => 10000, :ifs => 5000, :fns => 5000 }.each do |shape, depth|
+        ['-Aanf', '-Asrc', '-p'].each do |mode|
+          options = (mode == '-p') ? ['-p', '-Asrc'] : [mode]
+          out, err, status = Open3.capture3(*(['./sclpl'] + options), :stdin_data => nested(shape, depth))
+          expect([shape, mode, status.success?, err]).to eq([shape, mode, true, ""])
+        end
+      end
+    end
+
+    it "should reject deeper nesting with an error instead of crashing" do
+      [:calls, :ifs, :fns].each do |shape|
+        ['-Aanf', '-Asrc', '-p'].each do |mode|
+          options = (mode == '-p') ? ['-p', '-Asrc'] : [mode]
+          out, err, status = Open3.capture3(*(['./sclpl'] + options), :stdin_data => nested(shape, 200000))
+          expect(status.exitstatus).to eq(1)
+          expect(err =~ /^<stdin>:1:\d+:Error: Expression nested too deeply$/).not_to eq(nil)
+        end
+      end
+    end
+  end
 end
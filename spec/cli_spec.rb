@@ -1,4 +1,6 @@
 require 'spec_helper'
+require 'fileutils'
+require 'json'
 
 #describe "cli" do
 #  context "token mode" do
@@ -68,3 +70,300 @@ require 'spec_helper'
 #  end
 #end
 
+
+describe "cli" do
+  context "verbose mode" do
+    it "should report garbage collector statistics on exit" do
+      out, err, status = Open3.capture3('./sclpl', '-v', '-Asrc', :stdin_data => 'def foo 123;')
+      expect(status.success?).to eq(true)
+      expect(err =~ /^gc: \d+ collections, \d+ objects allocated, \d+ freed$/).not_to eq(nil)
+      expect(err =~ /^gc: \d+ cycle passes, \d+ objects freed from cycles$/).not_to eq(nil)
+      expect(err =~ /^gc: \d+ incremental sweep steps$/).not_to eq(nil)
+      expect(err =~ /^gc: \d+ objects allocated in regions$/).not_to eq(nil)
+      expect(err =~ /^gc: \d+ bytes live, \d+ bytes peak per thread, ZCT: \d+ MRT: \d+$/).not_to eq(nil)
+      expect(err =~ /^gc: \d+ us total pause, \d+ us longest pause$/).not_to eq(nil)
+    end
+  end
+
+  context "symbol pool" do
+    def allocated(input)
+      out, err, status = Open3.capture3('./sclpl', '-v', '-Aast', :stdin_data => input)
+      expect(status.success?).to eq(true)
+      err[/^gc: \d+ collections, (\d+) objects allocated/, 1].to_i
+    end
+
+    it "should store a repeated identifier only once" do
+      expect(allocated("foo(bar, foo)\n" * 100)).to eq(allocated("foo(bar, foo)\n"))
+    end
+
+    it "should store each distinct identifier" do
+      input = (1..100).map {|i| "foo#{i}(bar, foo)\n" }.join
+      expect(allocated(input)).to eq(allocated("foo(bar, foo)\n") + 100)
+    end
+  end
+
+  context "output" do
+    it "should print each top-level form on its own line" do
+      expect(cli(['-Aast'], "def foo 1;\nfoo(2)\n")).to eq(
+          "(def foo T_INT:1)\n(T_ID:foo T_INT:2)\n")
+    end
+  end
+
+  context "file input" do
+    it "should produce the same output as reading from stdin" do
+      input = File.read('spec/src/sample.scl')
+      ['-Atok', '-Aast', '-Asrc'].each do |mode|
+        expect(cli([mode, 'spec/src/sample.scl'])).to eq(cli([mode], input))
+      end
+    end
+
+    it "should fail when the input file does not exist" do
+      out, err, status = Open3.capture3('./sclpl', '-Atok', 'spec/src/missing.scl')
+      expect(status.success?).to eq(false)
+      expect(err =~ /^Unable to open 'spec\/src\/missing.scl'/).not_to eq(nil)
+    end
+  end
+
+  context "diagnostics" do
+    it "should report the file, line and column of a parse error" do
+      out, err, status = Open3.capture3('./sclpl', '-Aast', :stdin_data => "def a 1;\n\n  def b (;\n")
+      expect(status.success?).to eq(false)
+      expect(err).to eq("<stdin>:3:10:Error: Unexpected token\n")
+    end
+  end
+
+  context "pass manager" do
+    it "should report the time and memory of each pass" do
+      out, err, status = Open3.capture3('./sclpl', '-T', '-Asrc', :stdin_data => 'def foo 123;')
+      expect(status.success?).to eq(true)
+      ['lex', 'parse', 'normalize', 'codegen'].each do |pass|
+        expect(err =~ /^#{pass} +\d+ +\d+\.\d+ +\d+\.\d% +\d+ +\d+ +\d+$/).not_to eq(nil)
+      end
+    end
+
+    it "should take tree memory in proportion to the number of arguments" do
+      kb = [2000, 8000].map do |n|
+        input = "f(" + (1..n).map {|i| "g(#{i})" }.join(", ") + ")\n"
+        out, err, status = Open3.capture3('./sclpl', '-T', '-Aast', :stdin_data => input)
+        expect(status.success?).to eq(true)
+        err[/^parse +\d+ +\S+ +\S+ +\d+ +(\d+)/, 1].to_i
+      end
+      expect(kb[1] < 5 * kb[0]).to eq(true)
+    end
+
+    it "should skip a disabled pass" do
+      input = "def foo bar(baz());\n"
+      expect(cli(['-dnormalize', '-Aanf'], input)).to eq(cli(['-Aast'], input))
+    end
+
+    it "should skip folding when normalization is disabled" do
+      input = "def foo __iadd(1, 2);\n"
+      expect(cli(['-dnormalize', '-Asrc'], input)).to eq(cli(['-dnormalize', '-dfold', '-Asrc'], input))
+      expect(cli(['-dnormalize', '-efold', '-Asrc'], input) =~ /__iadd/).not_to eq(nil)
+    end
+
+    it "should refuse to disable a pass the output depends on" do
+      out, err, status = Open3.capture3('./sclpl', '-dparse', '-Aast', :stdin_data => '')
+      expect(status.success?).to eq(false)
+      expect(err =~ /^The 'parse' pass cannot be disabled$/).not_to eq(nil)
+    end
+
+    it "should reject an unknown pass" do
+      out, err, status = Open3.capture3('./sclpl', '-dfoo', '-Aast', :stdin_data => '')
+      expect(status.success?).to eq(false)
+      expect(err =~ /^Unknown pass: 'foo'$/).not_to eq(nil)
+    end
+  end
+
+  context "trace export" do
+    after(:each) do
+      FileUtils.rm_f('spec/trace.json')
+    end
+
+    it "should write a span per form for each pass and an event per collection" do
+      input = "def foo(a, b) def c b(a); if a then c(b) else foo(b, a) end end\n" * 20
+      out, err, status = Open3.capture3({'SCLPL_GC' => 'min=1'},
+          './sclpl', '--trace=spec/trace.json', '-Asrc', :stdin_data => input)
+      expect(status.success?).to eq(true)
+      events = JSON.parse(File.read('spec/trace.json'))['traceEvents']
+      ['parse', 'normalize', 'codegen'].each do |pass|
+        spans = events.select {|e| e['name'] == pass && e['ph'] == 'X' }
+        expect(spans.map {|e| e['args']['form'] }).to eq((1..20).to_a)
+      end
+      collections = events.select {|e| e['name'] == 'gc_collect' }
+      expect(collections.empty?).to eq(false)
+      expect(collections.all? {|e| e['ph'] == 'i' && e['args']['pause_us'] >= 0 }).to eq(true)
+    end
+
+    it "should tell apart the forms of files compiled together" do
+      FileUtils.mkdir_p('spec/tmp')
+      input = "def foo(a) bar(a);\n" * 5
+      ['spec/tmp/one.scl', 'spec/tmp/two.scl'].each {|f| File.write(f, input) }
+      out, err, status = Open3.capture3('./sclpl', '--trace=spec/trace.json', '-j2', '-Asrc',
+          'spec/tmp/one.scl', 'spec/tmp/two.scl')
+      FileUtils.rm_rf('spec/tmp')
+      expect(status.success?).to eq(true)
+      events = JSON.parse(File.read('spec/trace.json'))['traceEvents']
+      spans = events.select {|e| e['name'] == 'parse' && e['ph'] == 'X' }
+      expect(spans.map {|e| [e['args']['file'], e['args']['form']] }.sort).to eq(
+          ['spec/tmp/one.scl', 'spec/tmp/two.scl'].product((1..5).to_a))
+    end
+  end
+
+  context "pipelined mode" do
+    it "should produce the same C source as compiling serially" do
+      input = "def foo(a, b) def c b(a); if a then c(b) else foo(b, a) end end\n" * 200
+      expect(cli(['-p', '-Asrc'], input)).to eq(cli(['-Asrc'], input))
+    end
+
+    it "should fail on a parse error" do
+      input = "def a 1;\n" * 100 + "def b (;\n" + "def c 2;\n" * 100
+      out, err, status = Open3.capture3('./sclpl', '-p', '-Asrc', :stdin_data => input)
+      expect(status.success?).to eq(false)
+      expect(err).to eq("<stdin>:101:8:Error: Unexpected token\n")
+    end
+  end
+
+  context "multiple files" do
+    before(:each) do
+      FileUtils.mkdir_p('spec/tmp')
+      FileUtils.cp('spec/src/sample.scl', 'spec/tmp/one.scl')
+      FileUtils.cp('spec/src/sample.scl', 'spec/tmp/two.scl')
+    end
+
+    after(:each) do
+      FileUtils.rm_rf('spec/tmp')
+    end
+
+    it "should write the output for each file next to it" do
+      expected = cli(['-Aast'], File.read('spec/src/sample.scl'))
+      expect(cli(['-Aast', '-j2', 'spec/tmp/one.scl', 'spec/tmp/two.scl'])).to eq("")
+      expect(File.read('spec/tmp/one.ast')).to eq(expected)
+      expect(File.read('spec/tmp/two.ast')).to eq(expected)
+    end
+
+    it "should lex each file with a scanner of its own" do
+      first  = "def foo \"a string\";\n" * 500
+      second = "bar(1.5, \\c, 0h1F)\n" * 500
+      File.write('spec/tmp/one.scl', first)
+      File.write('spec/tmp/two.scl', second)
+      expect(cli(['-Atok', '-j2', 'spec/tmp/one.scl', 'spec/tmp/two.scl'])).to eq("")
+      expect(File.read('spec/tmp/one.tok')).to eq(cli(['-Atok', 'spec/tmp/one.scl']))
+      expect(File.read('spec/tmp/two.tok')).to eq(cli(['-Atok', 'spec/tmp/two.scl']))
+      expect(File.read('spec/tmp/one.tok') =~ /T_STRING/).not_to eq(nil)
+      expect(File.read('spec/tmp/two.tok') =~ /T_FLOAT/).not_to eq(nil)
+    end
+
+    it "should report errors in the order the files were given" do
+      File.write('spec/tmp/bad.scl', "def foo (;\n")
+      out, err, status = Open3.capture3('./sclpl', '-Aast', '-j2',
+          'spec/tmp/missing.scl', 'spec/tmp/one.scl', 'spec/tmp/bad.scl')
+      expect(status.success?).to eq(false)
+      expect(err.index('missing.scl') < err.index('bad.scl')).to eq(true)
+      expect(File.exist?('spec/tmp/one.ast')).to eq(true)
+      expect(File.exist?('spec/tmp/bad.ast')).to eq(false)
+    end
+  end
+
+  context "heap trees" do
+    inputs = [
+      File.read('spec/src/sample.scl'),
+      "def foo(a, b) def c b(a); if a then c(b) else foo(b, a) end end\n" * 50,
+      ('if a then ' * 2000) + 'b(c(1), 2) x' + (' end' * 2000),
+      ('fn(a) def q a; ' * 2000) + 'a' + (' end' * 2000),
+    ]
+
+    it "should produce the same output as arena trees while collecting constantly" do
+      ['min=1,growth=0', 'min=1,growth=0,noregions'].each do |options|
+        inputs.each do |input|
+          ['-Aast', '-Aanf', '-Asrc'].each do |mode|
+            out, err, status = Open3.capture3({'SCLPL_GC' => options},
+                './sclpl', '--trees=heap', mode, :stdin_data => input)
+            expect(status.success?).to eq(true)
+            expect(out).to eq(cli([mode], input))
+          end
+        end
+      end
+    end
+
+    it "should build each form in a region unless told not to" do
+      stats = ['', 'noregions'].map do |options|
+        out, err, status = Open3.capture3({'SCLPL_GC' => options},
+            './sclpl', '-v', '--trees=heap', '-Asrc', :stdin_data => inputs[1])
+        expect(status.success?).to eq(true)
+        [err[/^gc: (\d+) objects allocated in regions$/, 1].to_i,
+         err[/^gc: \d+ collections, (\d+) objects allocated, (\d+) freed$/, 2].to_i]
+      end
+      # Regions release every node of a form once it is compiled
+      expect(stats[0][0] > 1000).to eq(true)
+      expect(stats[0][1] >= stats[0][0]).to eq(true)
+      expect(stats[1][0]).to eq(0)
+    end
+
+    it "should allocate the nodes on the collected heap" do
+      allocated = ['--trees=arena', '--trees=heap'].map do |trees|
+        out, err, status = Open3.capture3('./sclpl', '-v', trees, '-Asrc', :stdin_data => inputs[1])
+        expect(status.success?).to eq(true)
+        err[/^gc: \d+ collections, (\d+) objects allocated/, 1].to_i
+      end
+      expect(allocated[1] > allocated[0] + 1000).to eq(true)
+    end
+
+    it "should search them for cycles without freeing live nodes" do
+      passes = ['cycles=0', 'cycles=1'].map do |options|
+        out, err, status = Open3.capture3({'SCLPL_GC' => "min=1,growth=0,noregions,#{options}"},
+            './sclpl', '-v', '--trees=heap', '-Asrc', :stdin_data => inputs[1])
+        expect(status.success?).to eq(true)
+        expect(out).to eq(cli(['-Asrc'], inputs[1]))
+        err[/^gc: (\d+) cycle passes, \d+ objects freed from cycles$/, 1].to_i
+      end
+      expect(passes[0]).to eq(0)
+      expect(passes[1] > 0).to eq(true)
+    end
+
+    it "should refuse to pass them between pipeline stages" do
+      out, err, status = Open3.capture3('./sclpl', '--trees=heap', '-p', '-Asrc', :stdin_data => '')
+      expect(status.success?).to eq(false)
+      expect(err).to eq("--trees=heap cannot be combined with -p\n")
+    end
+  end
+
+  context "garbage collection" do
+    # Tokens printed by -Atok are the only objects that become garbage
+    input = "def foo(a, b) def c b(a); if a then c(b) else foo(b, a) end end\n" * 50
+
+    def gc_run(options, input)
+      out, err, status = Open3.capture3({'SCLPL_GC' => options},
+          './sclpl', '-v', '-Atok', :stdin_data => input)
+      expect(status.success?).to eq(true)
+      stats = {}
+      err.scan(/(\d+) (collections|objects allocated in regions|objects allocated|freed|incremental sweep steps)/) do |n, name|
+        stats[name] = n.to_i
+      end
+      [out, stats]
+    end
+
+    it "should free the tokens it has printed" do
+      out, stats = gc_run('', input)
+      expect(stats['collections'] > 0).to eq(true)
+      expect(stats['freed'] > 0).to eq(true)
+      expect(stats['freed'] <= stats['objects allocated']).to eq(true)
+      expect(stats['incremental sweep steps']).to eq(0)
+    end
+
+    it "should collect more often with a lower minimum" do
+      out, stats = gc_run('', input)
+      stressed, stressed_stats = gc_run('min=1', input)
+      expect(stressed).to eq(out)
+      expect(stressed_stats['collections'] > stats['collections']).to eq(true)
+    end
+
+    it "should sweep between allocations when stepping" do
+      out, stats = gc_run('', input)
+      stepped, stepped_stats = gc_run('min=10,step=1', input)
+      expect(stepped).to eq(out)
+      expect(stepped_stats['incremental sweep steps'] > 0).to eq(true)
+      expect(stepped_stats['freed'] > 0).to eq(true)
+    end
+  end
+end
@@ -0,0 +1,123 @@
+require 'spec_helper'
+require 'fileutils'
+
+describe "constant folding" do
+  context "primitive operations" do
+    it "should fold integer arithmetic" do
+      expect(ccode('def a __iadd(1, __imul(2, 3));')).to eq("val a = 7;\n")
+    end
+
+    it "should fold integer comparisons" do
+      expect(ccode('def a __ilt(1, 2);')).to eq("val a = true;\n")
+      expect(ccode('def a __igte(1, 2);')).to eq("val a = false;\n")
+    end
+
+    it "should fold floating point arithmetic and comparisons" do
+      expect(ccode('def a __fadd(1.5, 2.25);')).to eq("val a = 3.75;\n")
+      expect(ccode('def a __feq(1.0, 1.0);')).to eq("val a = true;\n")
+    end
+
+    it "should keep every bit of a folded floating point result" do
+      [['__fdiv(1.0, 3.0)', 1.0 / 3.0], ['__fdiv(1.0, 10000000.0)', 1.0 / 10000000.0],
+       ['__fmul(0.1, 3.0)', 0.1 * 3.0], ['__fadd(1.0, 1.0)', 2.0]].each do |expr, value|
+        out = ccode("def a #{expr};")
+        expect(out =~ /\Aval a = ([^;]*[.e][^;]*);\n\z/).not_to eq(nil)
+        expect(Float($1)).to eq(value)
+      end
+    end
+
+    it "should leave results that overflow a double to run time" do
+      expect(ccode('def a __fmul(1.0e300, 1.0e300);')).to eq("val a = __fmul(1e+300,1e+300);\n")
+    end
+
+    it "should leave division by zero to run time" do
+      expect(ccode('def a __idiv(1, 0);')).to eq("val a = __idiv(1,0);\n")
+    end
+
+    it "should leave results that do not fit a tagged integer alone" do
+      expect(ccode('def a __imul(4611686018427387903, 2);')).to eq(
+          "val a = __imul(4611686018427387903,2);\n")
+    end
+
+    it "should leave applications of other functions alone" do
+      expect(ccode('def a foo(1, 2);')).to eq("val a = foo(1,2);\n")
+    end
+  end
+
+  context "shadowed primitives" do
+    it "should not fold a call of an argument named like a primitive" do
+      expect(ccode("def f(__iadd) __iadd(1, 2) end")).to eq(
+          "val f(val __iadd) {\n    {val _t0 = __iadd(1,2);\n    return _t0;}\n}\n\n")
+    end
+
+    it "should not fold a call of a local named like a primitive" do
+      expect(ccode("def f() def __iadd 5; __iadd(1, 2) end")).to eq(
+          "val f() {\n    {val __iadd = 5;\n    {val _t0 = __iadd(1,2);\n" +
+          "    return _t0;}}\n}\n\n")
+    end
+
+    it "should not fold a primitive redefined at the top level" do
+      expect(ccode("def __iadd 5;\n__iadd(1, 2)\n")).to eq(
+          "val __iadd = 5;\n__iadd(1,2)\n")
+    end
+
+    it "should fold the primitive again in the next input" do
+      FileUtils.mkdir_p('spec/tmp')
+      File.write('spec/tmp/one.scl', "def __iadd 5;\ndef a __iadd(1, 2);\n")
+      File.write('spec/tmp/two.scl', "def a __iadd(1, 2);\n")
+      expect(cli(['-Asrc', '-j1', 'spec/tmp/one.scl', 'spec/tmp/two.scl'])).to eq("")
+      expect(File.read('spec/tmp/one.c')).to eq("val __iadd = 5;\nval a = __iadd(1,2);\n")
+      expect(File.read('spec/tmp/two.c')).to eq("val a = 3;\n")
+    ensure
+      FileUtils.rm_rf('spec/tmp')
+    end
+  end
+
+  context "propagation" do
+    it "should replace temps bound to constants with their value" do
+      expect(ccode("def f(y) __iadd(y, __imul(2, 3)) end")).to eq(
+          "val f(val y) {\n    {val _t0 = __iadd(y,6);\n    return _t0;}\n}\n\n")
+    end
+
+    it "should replace names bound to constants with their value" do
+      expect(ccode("def f() def k 5; __ilt(k, 9) end")).to eq(
+          "val f() {\n    {val _t0 = true;\n    return true;}\n}\n\n")
+    end
+
+    it "should not replace names hidden by a function argument" do
+      expect(ccode("def f() def k 5; fn(k) __iadd(k, 1) end end")).to eq(
+          "val f() {\n    {val _t1 = (val k) {\n    {val _t0 = __iadd(k,1);\n" +
+          "    return _t0;}\n}\n;\n    return _t1;}\n}\n\n")
+    end
+
+    it "should not replace a name rebound to something unknown" do
+      expect(ccode("def f() def k 5; def k g(); __iadd(k, 1) end")).to eq(
+          "val f() {\n    {val k = g();\n    {val _t0 = __iadd(k,1);\n" +
+          "    return _t0;}}\n}\n\n")
+    end
+
+    it "should keep a constant that is called as a function" do
+      expect(ccode("def f() def k 5; k(1) end")).to eq(
+          "val f() {\n    {val k = 5;\n    {val _t0 = k(1);\n    return _t0;}}\n}\n\n")
+    end
+
+    it "should produce the same code as without it when nothing is constant" do
+      input = "def foo(a, b) def c b(a); if a then c(b) else foo(b, a) end end\n"
+      expect(ccode(input)).to eq(cli(['-dfold', '-Asrc'], input))
+    end
+
+    it "should fold primitive applications nested as deep as the passes allow" do
+      depth = 10000
+      input = "def x " + ("__iadd(1, " * depth) + "1" + (")" * depth) + ";"
+      expect(ccode(input)).to eq("val x = #{depth + 1};\n")
+    end
+
+    it "should reject deeper nesting with an error instead of crashing" do
+      depth = 200000
+      input = "def x " + ("__iadd(1, " * depth) + "1" + (")" * depth) + ";"
+      out, err, status = Open3.capture3('./sclpl', '-Asrc', :stdin_data => input)
+      expect(status.exitstatus).to eq(1)
+      expect(err =~ /^<stdin>:1:\d+:Error: Expression nested too deeply$/).not_to eq(nil)
+    end
+  end
+end
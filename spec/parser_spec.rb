@@ -255,6 +255,12 @@ describe "sclpl grammar" do
       it "should parse an application with two params" do
         expect(ast('foo(a,b)')).to eq([["T_ID:foo", "T_ID:a", "T_ID:b"]])
       end
+
+      it "should parse applications nested between params" do
+        expect(ast('foo(bar(a, baz(b)), c, qux(), quux(d))')).to eq([["T_ID:foo",
+            ["T_ID:bar", "T_ID:a", ["T_ID:baz", "T_ID:b"]], "T_ID:c",
+            ["T_ID:qux"], ["T_ID:quux", "T_ID:d"]]])
+      end
     end
   end
 
@@ -266,5 +272,18 @@ describe "sclpl grammar" do
     it "an invalid literal should error" do
       expect{ast('\'')}.to raise_error /Error/
     end
+
+    it "should parse applications nested deeper than the C stack" do
+      depth = 500000
+      expect(cli(['-Aast'], ('f(' * depth) + '1' + (')' * depth))).to eq(
+          ('(T_ID:f ' * depth) + 'T_INT:1' + (')' * depth) + "\n")
+    end
+
+    it "should parse blocks nested deeper than the C stack" do
+      depth = 200000
+      expected = (depth-1).downto(0).map {|t| "(if T_ID:a (let ($:#{t} " }.join +
+          "T_ID:b" + (0...depth).map {|t| ") $:#{t}) )" }.join + "\n"
+      expect(cli(['-Aast'], ('if a then ' * depth) + 'b' + (' end' * depth))).to eq(expected)
+    end
   end
 end
@@ -0,0 +1,51 @@
+require 'spec_helper'
+
+# Differential test of the hand-written scanner (make sclpl-simd) against the
+# flex lexer. Each token is printed with the line and column worked out from
+# its offset, so both have to agree on where every token starts.
+def tokens(bin, input)
+  out, err, status = Open3.capture3(bin, '-Atok', :stdin_data => input)
+  raise err unless status.success?
+  out
+end
+
+describe "simd scanner" do
+  before(:each) do
+    skip "build sclpl-simd to compare the scanners" unless File.exist?('./sclpl-simd')
+  end
+
+  [ "", "   \t\r\n ", "[](){}',;:&", "foo[bar](baz){qux}'a,b;c:d",
+    "end def if fn then else require true false",
+    "endx defs iff fnn thenx elsex requires truex falsex & && u8& a&b",
+    "0b101 0o707 0d909 0hF0F 0hf0f 0b102 0o8 0dff 0hfg 007 00 0b 0x1",
+    "123 +123 -123 + - 1.5 +1.5 -1.5e10 1.5e+3 1.5e 1. .5 1.5x 12ab",
+    "\\a \\space \\newline \\return \\tab \\vtab \\foo \\ \\( \\\" \\12 \\\n",
+    "\"\" \"str\" \"a\\\"b\" \"a\\\" b\" \"multi\nline\" \"unterminated",
+    "\"x\\\"",
+    "a_b A9 _ foo.bar a-b a+b $x #y @z ~ ! ? / * % ^ | < > =",
+  ].each do |input|
+    it "should match the flex lexer on #{input.inspect}" do
+      expect(tokens('./sclpl-simd', input)).to eq(tokens('./sclpl', input))
+    end
+  end
+
+  it "should match the flex lexer on the sample program" do
+    input = File.read('spec/src/sample.scl')
+    expect(tokens('./sclpl-simd', input)).to eq(tokens('./sclpl', input))
+  end
+
+  it "should report the line and column of each token" do
+    input = "def foo \"a\\nb\"\n  bar(1.5,\n\t\\c)\n"
+    expect(tokens('./sclpl-simd', input).lines.map {|l| l[/^\d+:\d+/] }).to eq(
+        ["1:1", "1:5", "1:9", "2:3", "2:6", "2:7", "2:10", "3:2", "3:4"])
+  end
+
+  it "should match the flex lexer on random input" do
+    pieces = [ "a", "zz", "_", "0", "1", "7", "9", "b", "o", "d", "h", "e",
+      ".", "+", "-", "\\", "\"", "'", "(", ")", "[", "]", "{", "}", ";", ",",
+      ":", "&", " ", "\t", "\n", "end", "def", "true", "\\space", "0b", "0h" ]
+    rng = Random.new(42)
+    input = Array.new(20000) { pieces[rng.rand(pieces.length)] }.join
+    expect(tokens('./sclpl-simd', input)).to eq(tokens('./sclpl', input))
+  end
+end